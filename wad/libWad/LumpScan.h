@@ -0,0 +1,40 @@
+#pragma once
+#include "Wad.h"
+#include <deque>
+
+// Bulk lump reading shared by the tools that walk a whole WAD (wadextract, waddiff)
+
+static const uint64_t spanSize = 16 << 20; // target size of one sequential read, bigger lumps go to visitLarge
+static const uint64_t maxGap = 64 << 10;   // unused bytes we'll read through to keep a span going
+static const uint64_t maxInFlight = 4;     // spans read but not yet handed back by their jobs
+
+// Fixed pool of threads fed from a queue, the destructor runs whatever is still queued
+class WorkerPool
+{
+public:
+    WorkerPool(int numThreads);
+    ~WorkerPool();
+    void submit(function<void()> job);
+
+private:
+    void run();
+
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex queueMutex;
+    condition_variable queueReady;
+    bool stopping = false;
+};
+
+// The order scanLumps hands lumps to the pool in: those bigger than spanSize first, then the rest,
+// each by shard and offset. Lists the indices into lumps.
+vector<size_t> scanOrder(const vector<LumpInfo> &lumps);
+
+// Reads the given lumps in on-disk order on the calling thread, merging neighbours into reads of up
+// to spanSize, and hands each one to a pool of numThreads threads. visit gets a lump's index in lumps
+// and its stored bytes (still compressed if it was written that way), or nullptr if the read came up
+// short. Lumps bigger than spanSize aren't buffered, visitLarge gets those and reads them itself.
+// Jobs are queued in scanOrder and the pool starts them first in, first out, so a job may wait for
+// one queued before it. Returns once every job has run.
+void scanLumps(Wad *wad, const vector<LumpInfo> &lumps, int numThreads,
+               const function<void(size_t, const char *)> &visit, const function<void(size_t)> &visitLarge);
@@ -3,14 +3,176 @@
 #include <stack>
 #include <fstream>
 #include <regex>
+#include <cstring>
+#include <fnmatch.h>
+#include <thread>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 using namespace std;
 
-Node::Node(uint32_t offset, uint32_t length, string name)
+// Stream buffer over a growable byte vector so the in-memory backend can share
+// the same read/write code as the file backend. Writes past the end grow the
+// vector, like writing past the end of a file.
+class MemoryStreamBuf : public streambuf
+{
+    vector<char> &data;
+    size_t pos = 0;
+
+protected:
+    streamsize xsgetn(char *s, streamsize n) override
+    {
+        if (pos >= data.size())
+            return 0;
+
+        streamsize count = min<streamsize>(n, data.size() - pos);
+        memcpy(s, data.data() + pos, count);
+        pos += count;
+        return count;
+    }
+
+    int_type underflow() override
+    {
+        if (pos >= data.size())
+            return traits_type::eof();
+        return traits_type::to_int_type(data[pos]);
+    }
+
+    int_type uflow() override
+    {
+        int_type c = underflow();
+        if (c != traits_type::eof())
+            ++pos;
+        return c;
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        if (pos + n > data.size())
+            data.resize(pos + n); // grow the buffer, zero filling any gap
+        memcpy(data.data() + pos, s, n);
+        pos += n;
+        return n;
+    }
+
+    int_type overflow(int_type c) override
+    {
+        if (c == traits_type::eof())
+            return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override
+    {
+        off_type base = 0;
+        if (dir == ios_base::cur)
+            base = pos;
+        else if (dir == ios_base::end)
+            base = data.size();
+
+        if (base + off < 0)
+            return pos_type(off_type(-1));
+
+        pos = base + off;
+        return pos_type(off_type(pos));
+    }
+
+    pos_type seekpos(pos_type p, ios_base::openmode which) override
+    {
+        return seekoff(off_type(p), ios_base::beg, which);
+    }
+
+public:
+    MemoryStreamBuf(vector<char> &data) : data(data) {}
+};
+
+class MemoryStream : public iostream
+{
+    MemoryStreamBuf buf;
+
+public:
+    MemoryStream(vector<char> &data) : iostream(nullptr), buf(data) { rdbuf(&buf); }
+};
+
+// CRC32C (Castagnoli) without hardware help: slicing-by-8, eight table lookups per 8 bytes
+struct Crc32cTables
+{
+    uint32_t table[8][256];
+
+    Crc32cTables()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+    }
+};
+
+static uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t length)
+{
+    static const Crc32cTables tables;
+    const uint32_t(*t)[256] = tables.table;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+
+    for (; length >= 8; p += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF] ^
+              t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^ t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+    }
+    for (; length > 0; p++, length--)
+    {
+        crc = t[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SSE4.2 crc32 instruction computes the same polynomial, 8 bytes at a time
+__attribute__((target("sse4.2"))) static uint32_t crc32cHardware(uint32_t crc, const char *data, size_t length)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+#endif
+    for (; length > 0; data++, length--)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+Node::Node(uint64_t offset, uint64_t length, string name)
 {
     this->offset = offset;
     this->length = length;
+    this->shard = 0;
     this->name = name;
+    this->probed = false;
+    this->materialized = true;
 }
 
 Node::~Node()
@@ -22,119 +184,361 @@ Node::~Node()
     children.clear(); // Clear the vector after deletion
 }
 
-Wad::Wad(const string &path)
+Wad::Wad(const string &path, const LoadOptions &options)
 {
     // open the file
     fileName = path;
+    inMemory = false;
+    lazyTree = options.lazyTree; // decides how much of the tree buildNodes builds
+    treeMemoryBudget = options.treeMemoryBudget;
+
+    // Finish any header/table update that was interrupted by a crash
+    recoverJournal();
+
     fstream file(fileName, ios::binary | ios::in | ios::out);
     if (!file)
     {
         throw runtime_error("Failed to open: " + path);
     }
 
+    buildTree(file);
+    file.close();
+}
+
+Wad::Wad(vector<char> &&buffer)
+{
+    // the buffer is the whole WAD, nothing is read from disk
+    inMemory = true;
+    memBuffer = move(buffer);
+    if (memBuffer.size() < 12)
+    {
+        throw runtime_error("Buffer too small to hold a WAD header");
+    }
+
+    MemoryStream stream(memBuffer);
+    buildTree(stream);
+}
+
+Wad::Wad(const Wad &source, vector<Descriptor> &&table)
+{
+    // Lump data is only ever written to fresh space, so an old copy of the table keeps describing
+    // valid data. The view reads the same files through its own streams and its own treeMutex.
+    fileName = source.fileName;
+    inMemory = false;
+    readOnly = true;
+    lazyTree = true; // only directories up front, so a snapshot costs little more than the table copy
+    memcpy(magic, source.magic, 5);
+    extended = source.extended;
+    numShards = source.numShards;
+    descriptorOffset = source.descriptorOffset;
+    tableAtEnd = false;
+    tableCapacity = 0;
+    chunkCacheLimit = source.chunkCacheLimit;
+    cacheBudget = source.cacheBudget;
+    if (cacheBudget)
+    {
+        cacheBudget->add(this);
+    }
+
+    descriptors = move(table);
+    numDescriptors = descriptors.size();
+    for (Descriptor &descriptor : descriptors)
+    {
+        descriptor.node = nullptr;
+    }
+    buildNodes();
+}
+
+void Wad::buildTree(istream &file)
+{
     // Read & update variables
     file.read(magic, 4);
-    file.read(reinterpret_cast<char *>(&numDescriptors), 4);
-    file.read(reinterpret_cast<char *>(&descriptorOffset), 4);
+    magic[4] = '\0';
+    extended = memcmp(magic, extendedMagic, 4) == 0;
+    numShards = 1;
+
+    if (extended) // 64-bit offset in the header, counts live in front of the descriptor table
+    {
+        file.read(reinterpret_cast<char *>(&descriptorOffset), 8);
+        file.seekg(descriptorOffset, ios::beg);
+        file.read(reinterpret_cast<char *>(&numDescriptors), 8);
+        file.read(reinterpret_cast<char *>(&numShards), 4);
+    }
+    else
+    {
+        uint32_t count;
+        uint32_t offset;
+        file.read(reinterpret_cast<char *>(&count), 4);
+        file.read(reinterpret_cast<char *>(&offset), 4);
+        numDescriptors = count;
+        descriptorOffset = offset;
+    }
+
+    if (!file)
+    {
+        throw runtime_error("Failed to read WAD header");
+    }
+
+    // Checked up front, a bogus count shouldn't allocate (or overflow the table size) past the end of the WAD
+    uint64_t wadSize = memBuffer.size();
+    if (!inMemory)
+    {
+        file.seekg(0, ios::end);
+        wadSize = max<streamoff>(file.tellg(), 0);
+    }
+    if (descriptorOffset > wadSize || tableStart() > wadSize || numDescriptors > (wadSize - tableStart()) / descriptorSize())
+    {
+        throw runtime_error("Descriptor table runs past the end of the WAD");
+    }
+
+    // Read the whole descriptor table in one go
+    vector<char> table(numDescriptors * descriptorSize());
+    file.seekg(tableStart(), ios::beg);
+    file.read(table.data(), table.size());
+    if (!file)
+    {
+        throw runtime_error("Descriptor table runs past the end of the WAD");
+    }
+
+    descriptors.resize(numDescriptors);
+    for (uint64_t i = 0; i < numDescriptors; i++)
+    {
+        decodeDescriptor(table.data() + i * descriptorSize(), descriptors[i]);
+        const Descriptor &descriptor = descriptors[i];
+        if (inMemory && (descriptor.offset > memBuffer.size() || descriptor.length > memBuffer.size() - descriptor.offset))
+        {
+            throw runtime_error("Lump " + descriptor.name + " runs past the end of the buffer");
+        }
+    }
+
+    // New descriptors can only be appended in place if nothing follows the table
+    file.seekg(0, ios::end);
+    tableAtEnd = uint64_t(file.tellg()) == tableStart() + table.size();
+    tableCapacity = tableStart() - descriptorOffset + table.size();
+
+    buildNodes();
+}
+
+void Wad::buildNodes()
+{
+    buildRanges();
 
     // Make the root directory
     Node *root = new Node(0, 0, "/");
     root->children.clear();
-    nodesMap["/"] = root;
+    root->materialized = !lazyTree;
+    addToIndex("/", root);
 
     // add root to stack
     stack<Node *> stack;
     stack.push(root);
 
-    // Ensures that file pointer begins reading the descriptor at correct place
-    file.seekg(descriptorOffset, ios::beg);
-
-    // Make regex patterns
-    regex startRegex(".*_START$");
-    regex endRegex(".*_END$");
-    regex mapMarkerRegex("^E\\dM\\d$");
-
-    for (int i = 0; i < numDescriptors; ++i)
+    // Plain suffix checks rather than regex_match, this runs once per descriptor
+    for (uint64_t i = 0; i < descriptors.size(); ++i)
     {
-        uint32_t offset;
-        uint32_t length;
-        char name[9] = {0};
-
-        file.read(reinterpret_cast<char *>(&offset), 4);
-        file.read(reinterpret_cast<char *>(&length), 4);
-        file.read(name, 8);
-        string nameStr(name);
+        Descriptor &descriptor = descriptors[i];
+        string nameStr = descriptor.name;
 
-        if (regex_match(nameStr, startRegex)) // namespace directory "_START"
+        if (endsWith(nameStr, "_START")) // namespace directory "_START"
         {
-            nameStr = nameStr.substr(0, nameStr.size() - 6);       // Remove "_START"
-            Node *currentNode = new Node(offset, length, nameStr); // make new descriptor
+            nameStr = nameStr.substr(0, nameStr.size() - 6); // Remove "_START"
+            Node *currentNode = newNode(i, nameStr); // make new descriptor
 
             currentNode->children.clear();
+            currentNode->materialized = !lazyTree;
             stack.top()->children.push_back(currentNode); // Add to parent directory
 
             // Update path and add to map
             string dirPath = stack.top()->name + currentNode->name + "/";
-            nodesMap[dirPath] = currentNode;
+            addToIndex(dirPath, currentNode);
             currentNode->name = dirPath;
 
             stack.push(currentNode);
         }
-        else if (regex_match(nameStr, endRegex)) // namespace directory "_END"
+        else if (endsWith(nameStr, "_END")) // namespace directory "_END"
         {
-            stack.pop(); // pop because it is the end of the current directory
+            if (stack.size() > 1)
+                stack.pop(); // pop because it is the end of the current directory
         }
-        else if (regex_match(nameStr, mapMarkerRegex)) // map directory
+        else if (isMapMarker(nameStr)) // map directory
         {
-            Node *currentNode = new Node(offset, length, nameStr); // make new descriptor
+            Node *currentNode = newNode(i, nameStr); // make new descriptor
             currentNode->children.clear();
+            currentNode->materialized = !lazyTree;
 
             // Update path and add to map
             string dirPath = stack.top()->name + currentNode->name + "/";
             currentNode->name = dirPath;
             stack.top()->children.push_back(currentNode);
-            nodesMap[dirPath] = currentNode;
+            addToIndex(dirPath, currentNode);
 
             stack.push(currentNode);
 
-            for (int j = 0; j < 10; j++) // files in map marker directory
+            for (int j = 0; j < 10 && i + 1 < descriptors.size(); j++) // files in map marker directory
             {
                 i++;
-                file.read(reinterpret_cast<char *>(&offset), 4);
-                file.read(reinterpret_cast<char *>(&length), 4);
-                file.read(name, 8);
+                if (lazyTree) // built by materialize
+                    continue;
 
-                Node *currentFile = new Node(offset, length, name);
+                Node *currentFile = newNode(i, descriptors[i].name);
 
-                string filePath = stack.top()->name + name;
+                string filePath = stack.top()->name + descriptors[i].name;
 
                 currentFile->name = filePath;
                 stack.top()->children.push_back(currentFile);
-                nodesMap[filePath] = currentFile;
+                addToIndex(filePath, currentFile);
             }
             stack.pop();
         }
-        else
-        {                                                          // File
-            Node *currentNode = new Node(offset, length, nameStr); // make new descriptor
+        else if (!lazyTree)
+        {                                                     // File
+            Node *currentNode = newNode(i, nameStr); // make new descriptor
             string filePath = stack.top()->name + currentNode->name;
 
             currentNode->name = filePath;
             stack.top()->children.push_back(currentNode); // Add file to parent directory
-            nodesMap[filePath] = currentNode;             // Update map with full path
+            addToIndex(filePath, currentNode);            // Update map with full path
         }
     }
     while (!stack.empty())
     {
         stack.pop();
     }
-    file.close();
+}
+
+Node *Wad::newNode(uint64_t index, const string &name)
+{
+    Descriptor &descriptor = descriptors[index];
+    Node *node = new Node(descriptor.offset, descriptor.length, name);
+    node->shard = descriptor.shard;
+    descriptor.node = node;
+    descriptorIndex[node] = index;
+    return node;
+}
+
+void Wad::buildRanges()
+{
+    // Same grammar as buildNodes: a map marker owns the next 10 descriptors whatever their names,
+    // a namespace runs to its matching _END
+    rangeEnds.assign(descriptors.size(), 0);
+    vector<uint64_t> open;
+    for (uint64_t i = 0; i < descriptors.size();)
+    {
+        const string &name = descriptors[i].name;
+        rangeEnds[i] = i + 1;
+        if (endsWith(name, "_START"))
+        {
+            open.push_back(i);
+            i++;
+        }
+        else if (endsWith(name, "_END"))
+        {
+            if (!open.empty())
+            {
+                rangeEnds[open.back()] = i + 1;
+                open.pop_back();
+            }
+            i++;
+        }
+        else if (isMapMarker(name))
+        {
+            rangeEnds[i] = i + 11; // not capped, a short map at the end of the table owns what gets appended
+            uint64_t end = min<uint64_t>(descriptors.size(), i + 11);
+            for (uint64_t j = i + 1; j < end; j++)
+            {
+                rangeEnds[j] = j + 1;
+            }
+            i = end;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    for (uint64_t start : open)
+    {
+        rangeEnds[start] = openRange;
+    }
+}
+
+void Wad::insertDescriptors(uint64_t at, const vector<Descriptor> &added)
+{
+    uint64_t count = added.size();
+    descriptors.insert(descriptors.begin() + at, added.begin(), added.end());
+    numDescriptors = descriptors.size();
+
+    // Namespaces that contain the insert point grow by the new entries, map windows keep their size
+    for (uint64_t i = 0; i < at; i++)
+    {
+        if (rangeEnds[i] > at && rangeEnds[i] != openRange && !isMapMarker(descriptors[i].name))
+        {
+            rangeEnds[i] += count;
+        }
+    }
+
+    // Ranges of the new entries, a new directory brings its own marker pair
+    vector<uint64_t> ends(count);
+    vector<uint64_t> open;
+    for (uint64_t k = 0; k < count; k++)
+    {
+        ends[k] = at + k + 1;
+        if (endsWith(added[k].name, "_START"))
+        {
+            open.push_back(k);
+        }
+        else if (endsWith(added[k].name, "_END") && !open.empty())
+        {
+            ends[open.back()] = at + k + 1;
+            open.pop_back();
+        }
+    }
+    for (uint64_t k : open)
+    {
+        ends[k] = openRange;
+    }
+    rangeEnds.insert(rangeEnds.begin() + at, ends.begin(), ends.end());
+
+    // Everything from the insert point onwards moved
+    for (uint64_t i = at; i < descriptors.size(); i++)
+    {
+        if (i >= at + count && rangeEnds[i] != openRange)
+        {
+            rangeEnds[i] += count;
+        }
+        if (descriptors[i].node != nullptr)
+        {
+            descriptorIndex[descriptors[i].node] = i;
+        }
+    }
 }
 
 Wad::~Wad()
 {
+    if (cacheBudget) // hand our chunks' bytes back to the other members
+    {
+        cacheBudget->remove(this);
+    }
+
+    // Stop the periodic sync thread and make whatever is still pending durable
+    if (syncThread.joinable())
+    {
+        {
+            lock_guard<mutex> lock(commitMutex);
+            stopSync = true;
+        }
+        syncWake.notify_all();
+        syncThread.join();
+    }
+    if (journaled())
+    {
+        waitDurable(writeSequence);
+    }
+
     delete nodesMap["/"];
     nodesMap.clear();
+    descriptorIndex.clear();
+    nameIndex.clear();
+    contentIndex.clear();
 }
 
 Wad *Wad::loadWad(const string &path) // TODO: destructor
@@ -143,12 +547,112 @@ Wad *Wad::loadWad(const string &path) // TODO: destructor
     return wad;
 }
 
+Wad *Wad::loadWad(const string &path, const LoadOptions &options)
+{
+    Wad *wad = new Wad(path, options);
+    wad->applyOptions(options);
+    return wad;
+}
+
+void Wad::applyOptions(const LoadOptions &options)
+{
+    durability = inMemory ? Durability::None : options.durability;
+    syncIntervalMs = options.syncIntervalMs;
+    if (durability == Durability::Periodic)
+    {
+        syncThread = thread(&Wad::syncLoop, this);
+    }
+
+    compressWrites = options.compressWrites;
+    chunkCacheLimit = options.chunkCacheSize;
+    cacheBudget = options.cacheBudget;
+    if (cacheBudget)
+    {
+        cacheBudget->add(this);
+    }
+    shardSize = options.shardSize;
+    if ((options.extendedFormat || options.shardSize > 0) && !convertToExtended())
+    {
+        throw runtime_error("Failed to convert to the extended format: " + fileName);
+    }
+    if (options.hashContents)
+    {
+        hashContents(options.numThreads);
+    }
+
+    verifyReads = options.verifyReads;
+    checksumsEnabled = options.checksums || options.verifyReads;
+    if (checksumsEnabled)
+    {
+        loadChecksums();
+    }
+}
+
+Wad *Wad::loadWadFromBuffer(const char *data, size_t size)
+{
+    return new Wad(vector<char>(data, data + size));
+}
+
+Wad *Wad::loadWadFromBuffer(vector<char> &&buffer)
+{
+    return new Wad(move(buffer));
+}
+
+unique_ptr<iostream> Wad::openStream()
+{
+    if (inMemory)
+    {
+        return unique_ptr<iostream>(new MemoryStream(memBuffer));
+    }
+    return unique_ptr<iostream>(new fstream(fileName, ios::in | ios::out | ios::binary));
+}
+
+bool Wad::isInMemory() const
+{
+    return inMemory;
+}
+
+const vector<char> &Wad::getBuffer() const
+{
+    return memBuffer;
+}
+
+vector<char> Wad::releaseBuffer()
+{
+    vector<char> released = move(memBuffer);
+    memBuffer.clear();
+    return released;
+}
+
+bool Wad::flushToFile(const string &path)
+{
+    ofstream out(path, ios::out | ios::binary | ios::trunc);
+    if (!out)
+    {
+        cerr << "Failed to open file: " << path << endl;
+        return false;
+    }
+
+    if (inMemory)
+    {
+        out.write(memBuffer.data(), memBuffer.size());
+    }
+    else
+    {
+        ifstream in(fileName, ios::in | ios::binary);
+        out << in.rdbuf();
+    }
+
+    out.flush();
+    return out.good();
+}
+
 string Wad::getMagic()
 {
     return magic;
 }
 
-bool Wad::isContent(const string &path)
+bool Wad::contentExists(const string &path)
 {
     // invalid path
     if (path[0] != '/' || path.empty() || path.back() == '/')
@@ -164,7 +668,7 @@ bool Wad::isContent(const string &path)
     return true;
 }
 
-bool Wad::isDirectory(const string &path)
+bool Wad::directoryExists(const string &path)
 {
     if (path[0] != '/' || path.empty()) // invalid
         return false;
@@ -183,47 +687,89 @@ bool Wad::isDirectory(const string &path)
     return true;
 }
 
-int Wad::getSize(const string &path)
+bool Wad::isContent(const string &path)
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+    makeResident(parentDirectory(path), lock);
+    return contentExists(path);
+}
+
+bool Wad::isDirectory(const string &path)
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+    return directoryExists(path);
+}
+
+int64_t Wad::getSize(const string &path)
 {
-    if (!isContent(path)) // invalid
+    shared_lock<shared_mutex> lock(treeMutex);
+    makeResident(parentDirectory(path), lock);
+    if (!contentExists(path)) // invalid
         return -1;
 
     Node *node = nodesMap[path];
+    ChunkTable *chunks = getChunkTable(node);
+    if (chunks != nullptr) // report the uncompressed size so callers see an ordinary file
+        return chunks->logicalSize;
+
     return node->length;
 }
 
-int Wad::getContents(const string &path, char *buffer, int length, int offset)
+int64_t Wad::getContents(const string &path, char *buffer, int64_t length, int64_t offset)
 {
-    if (!isContent(path))
+    shared_lock<shared_mutex> lock(treeMutex);
+    makeResident(parentDirectory(path), lock);
+
+    if (!contentExists(path))
         return -1;
 
-    fstream file(fileName, ios::in | ios::out | ios::binary);
-    if (!file.is_open())
+    Node *node = nodesMap[path];
+    if (verifyReads && !verifyLump(node)) // checked once, later reads use the cached result
     {
-        throw runtime_error("Failed to open: " + path);
+        return -1;
     }
 
-    int fileLength = nodesMap[path]->length;
-    int fileOffset = nodesMap[path]->offset;
+    ChunkTable *chunks = getChunkTable(node);
+    if (chunks != nullptr)
+    {
+        return readCompressed(node, chunks, buffer, length, offset);
+    }
+
+    int64_t fileLength = node->length;
 
     if (offset >= fileLength)
     { // offset goes beyond end of file
-        file.close();
         return 0;
     }
 
-    int readLength = min(length, fileLength - offset);
+    int64_t readLength = min(length, fileLength - offset);
 
-    file.seekg(fileOffset + offset, ios::beg);
-    file.read(buffer, readLength);
-    file.close();
+    if (inMemory) // no stream needed, copy straight out of the buffer
+    {
+        uint64_t position = node->offset + offset;
+        if (offset < 0 || position >= memBuffer.size())
+        {
+            return 0;
+        }
+        readLength = min<int64_t>(readLength, memBuffer.size() - position); // never past the image, whatever the table says
+        memcpy(buffer, memBuffer.data() + position, readLength);
+        return readLength;
+    }
+
+    vector<unique_ptr<iostream>> streams;
+    if (!readLump(streams, node, offset, buffer, readLength))
+    {
+        return -1; // truncated WAD or missing shard, same as a bad chunk in readCompressed
+    }
 
     return readLength;
 }
 
 int Wad::getDirectory(const string &path, vector<string> *directory)
 {
-    if (!isDirectory(path))
+    shared_lock<shared_mutex> lock(treeMutex);
+
+    if (!directoryExists(path))
     {
         return -1;
     }
@@ -235,6 +781,7 @@ int Wad::getDirectory(const string &path, vector<string> *directory)
     }
 
     Node *currentDirectory = nodesMap[p];
+    makeResident(currentDirectory, lock);
     int numChildren = 0;
     for (auto child : currentDirectory->children)
     {
@@ -249,24 +796,38 @@ int Wad::getDirectory(const string &path, vector<string> *directory)
 
 void Wad::createDirectory(const string &path)
 {
-    // no inputted path or no root directory
-    if (path.empty() || path[0] != '/')
-    {
+    if (readOnly)
         return;
-    }
 
-    vector<string> pathVec = tokenizePath(path);
-
-    // Check that name of directory is valid length
-    if (pathVec.back().length() > 2)
+    uint64_t ticket = 0;
     {
-        return;
+        unique_lock<shared_mutex> lock(treeMutex);
+        if (addDirectory(path))
+            ticket = ++writeSequence;
+    }
+    commit(ticket); // waits for the change to be durable if the durability mode asks for it
+}
+
+bool Wad::addDirectory(const string &path)
+{
+    // no inputted path or no root directory
+    if (path.empty() || path[0] != '/')
+    {
+        return false;
+    }
+
+    vector<string> pathVec = tokenizePath(path);
+
+    // Check that name of directory is valid length
+    if (pathVec.back().length() > 2)
+    {
+        return false;
     }
 
     // Check if directory already exists
-    if (isDirectory(path))
+    if (directoryExists(path))
     {
-        return;
+        return false;
     }
 
     // Check if parent directory exists & it is a namespace directory
@@ -281,9 +842,9 @@ void Wad::createDirectory(const string &path)
             parentEnd = pathVec[i];
     }
 
-    if (!isDirectory(parentPath) || regex_match(parentEnd, mapMarkerRegex))
+    if (!directoryExists(parentPath) || regex_match(parentEnd, mapMarkerRegex))
     {
-        return;
+        return false;
     }
 
     // All necessary checks complete, create the new directory
@@ -291,196 +852,65 @@ void Wad::createDirectory(const string &path)
     string startMarkerName = newDirName + "_START";
     string endMarkerName = newDirName + "_END";
 
-    // Get the names of the end marker of the parent directory
-    parentEnd += "_END";
-
     string p = path;
     if (p.back() != '/')
         p += "/";
 
     // Open the WAD file
-    fstream wadFile;
-    wadFile.open(fileName, ios::in | ios::out | ios::binary);
-    if (!wadFile.is_open())
+    unique_ptr<iostream> stream = openStream();
+    iostream &wadFile = *stream;
+    if (!wadFile)
     {
         cerr << "Failed to open file: " << fileName << endl;
-        return;
-    }
-
-    // Update number of descriptors
-    numDescriptors += 2;
-    wadFile.seekg(4, ios::beg);
-    wadFile.write(reinterpret_cast<char *>(&numDescriptors), sizeof(numDescriptors));
-
-    // Handle the root directory case
-    if (parentPath == "/")
-    {
-        // Create a new directory node
-        Node *newDir = new Node(0, 0, p);
-        Node *parentNode = nodesMap[parentPath];
-        parentNode->children.push_back(newDir);
-        nodesMap[p] = newDir;
-
-        // Write in the new directory information in the end of the descriptor list
-        wadFile.seekp(0, ios::end);
-        uint32_t newDescStart = wadFile.tellp();
-
-        wadFile.write(reinterpret_cast<char *>(&newDir->offset), 4);
-        wadFile.write(reinterpret_cast<char *>(&newDir->length), 4);
-        wadFile.write(startMarkerName.c_str(), 8);
-        wadFile.write(reinterpret_cast<char *>(&newDir->offset), 4);
-        wadFile.write(reinterpret_cast<char *>(&newDir->length), 4);
-        wadFile.write(endMarkerName.c_str(), 8);
-
-        wadFile.close();
-        return;
-    }
-
-    // Start reading from the file descriptor list
-    wadFile.seekg(descriptorOffset, ios::beg);
-    streampos parentEndPos = -1;
-    char buffer[16];
-
-    vector<string> currDirVec;
-    regex startRegex(".*_START$");
-    regex endRegex(".*_END$");
-
-    while (wadFile.read(buffer, sizeof(buffer)) || wadFile.gcount() > 0)
-    {
-        size_t bytesRead = wadFile.gcount();
-
-        // Extract the name and trim it
-        string nameInBuffer = string(buffer + 8, 8);
-
-        // Trim spaces and null characters
-        nameInBuffer.erase(0, nameInBuffer.find_first_not_of(' '));                                     // Trim leading spaces
-        nameInBuffer.erase(nameInBuffer.find_last_not_of(' ') + 1);                                     // Trim trailing spaces
-        nameInBuffer.erase(remove(nameInBuffer.begin(), nameInBuffer.end(), '\0'), nameInBuffer.end()); // Remove null characters
-
-        if (regex_match(nameInBuffer, startRegex))
-        {
-            string name;
-            name = nameInBuffer.substr(0, nameInBuffer.size() - 6); // Remove "_START"
-            currDirVec.push_back(name);
-        }
-        else if (regex_match(nameInBuffer, endRegex))
-        {
-            if (nameInBuffer != parentEnd)
-            {
-                currDirVec.pop_back();
-            }
-        }
-
-        // Check if the name matches the parent end marker
-        if (bytesRead >= 8 && nameInBuffer == parentEnd) // check for end of parent directory
-        {
-            string currDir = "/";
-            for (auto i : currDirVec)
-            {
-                currDir += i + "/";
-            }
-
-            if (parentPath == currDir) // check ENTIRE path
-            {
-                parentEndPos = wadFile.tellg();
-                parentEndPos -= 16; // Adjust to the start of the current buffer
-                break;
-            }
-            else
-            {
-                currDirVec.pop_back();
-            }
-        }
+        return false;
     }
 
-    if (parentEndPos == -1) // Parent end marker not found
+    // The markers go right before the end marker of the parent directory
+    Node *parentNode = nodesMap[parentPath];
+    int64_t insertIndex = findInsertIndex(parentNode);
+    if (insertIndex == -1) // Parent end marker not found
     {
-        wadFile.close();
-        return;
+        return false;
     }
 
-    shiftDataForward(wadFile, parentEndPos, 32);
-
     // Create a new directory node
     Node *newDir = new Node(0, 0, p);
-    Node *parentNode = nodesMap[parentPath];
+    newDir->materialized = !lazyTree;
     parentNode->children.push_back(newDir);
-    nodesMap[p] = newDir;
-
-    // Write the new directory information before the end of the parent directory
-    wadFile.seekp(parentEndPos, ios::beg); // Ensure we're at the right position before the shift
+    addToIndex(p, newDir);
 
-    // Writing the new directory data
-    wadFile.write(reinterpret_cast<char *>(&newDir->offset), 4);
-    wadFile.write(reinterpret_cast<char *>(&newDir->length), 4);
-    wadFile.write(startMarkerName.c_str(), 8);
-    wadFile.write(reinterpret_cast<char *>(&newDir->offset), 4);
-    wadFile.write(reinterpret_cast<char *>(&newDir->length), 4);
-    wadFile.write(endMarkerName.c_str(), 8);
+    // Add the markers to the descriptor list and write everything from them onwards
+    makeRoomForDescriptors(wadFile, 2);
+    Descriptor startMarker = {0, 0, 0, startMarkerName, newDir};
+    Descriptor endMarker = {0, 0, 0, endMarkerName, nullptr};
+    insertDescriptors(insertIndex, {startMarker, endMarker});
+    writeDescriptors(wadFile, insertIndex, descriptors.size());
 
-    // Make sure the file is flushed and closed correctly
+    // Make sure the file is flushed correctly, it is closed when the stream goes away
     wadFile.flush();
-    wadFile.close();
+    return true;
 }
 
-void Wad::shiftDataForward(fstream &wadFile, streampos startPos, size_t shiftAmount)
+void Wad::createFile(const string &path)
 {
-    if (startPos < 0)
-    {
-        cerr << "Invalid startPos!" << endl;
+    if (readOnly)
         return;
-    }
-
-    // Seek to the end of the file to determine the file size
-    wadFile.seekg(0, ios::end);
-    streampos fileEnd = wadFile.tellg();
-
-    // Calculate the new file size after shifting
-    streampos newFileSize = fileEnd + static_cast<streamoff>(shiftAmount);
-
-    // Extend the file to accommodate the shift if needed
-    if (startPos + static_cast<streamoff>(shiftAmount) > fileEnd)
-    {
-        wadFile.seekp(0, ios::end);                                          // Move to the current end of the file
-        vector<char> padding(static_cast<size_t>(newFileSize - fileEnd), 0); // Padding with zeros
-        wadFile.write(padding.data(), padding.size());
-    }
-
-    // Buffer for shifting
-    const size_t bufferSize = 1024; // Choose a reasonable buffer size
-    vector<char> tempBuffer(bufferSize);
 
-    // Loop backward through the file, shifting chunks of data
-    for (streampos pos = fileEnd; pos > startPos; pos -= static_cast<streamoff>(bufferSize))
+    uint64_t ticket = 0;
     {
-        // Calculate how much data to read in this chunk
-        streamoff toRead = min(
-            static_cast<streamoff>(bufferSize), pos - startPos);
-
-        // Read chunk from current position
-        wadFile.seekg(pos - toRead, ios::beg);
-        wadFile.read(tempBuffer.data(), static_cast<size_t>(toRead));
-
-        // Write chunk to new position
-        wadFile.seekp(pos - toRead + static_cast<streamoff>(shiftAmount), ios::beg);
-        wadFile.write(tempBuffer.data(), static_cast<size_t>(toRead));
+        unique_lock<shared_mutex> lock(treeMutex);
+        if (addFile(path))
+            ticket = ++writeSequence;
     }
-
-    // Fill the gap created at the start position with zeros
-    wadFile.seekp(startPos, ios::beg);
-    vector<char> zeroFill(static_cast<size_t>(shiftAmount), 0);
-    wadFile.write(zeroFill.data(), zeroFill.size());
-
-    // Flush changes to ensure they're written to disk
-    wadFile.flush();
+    commit(ticket);
 }
 
-void Wad::createFile(const string &path)
+bool Wad::addFile(const string &path)
 {
     // no inputted path or no root directory
     if (path.empty() || path[0] != '/')
     {
-        return;
+        return false;
     }
 
     vector<string> pathVec = tokenizePath(path);
@@ -488,7 +918,7 @@ void Wad::createFile(const string &path)
     // Check that name of file is valid length
     if (pathVec.back().length() > 8)
     {
-        return;
+        return false;
     }
 
     // Check for illegal phrases
@@ -498,13 +928,20 @@ void Wad::createFile(const string &path)
     string name = pathVec.back();
     if (regex_match(name, mapMarkerRegex) || regex_match(name, startRegex) || regex_match(name, endRegex))
     {
-        return;
+        return false;
+    }
+
+    // Lazy tree: the siblings have to exist before we can tell whether the file does
+    Node *parent = parentDirectory(path);
+    if (parent != nullptr && !parent->materialized)
+    {
+        materialize(parent);
     }
 
     // Check if file already exists
-    if (isContent(path))
+    if (contentExists(path))
     {
-        return;
+        return false;
     }
 
     // Check if parent directory exists & it is a namespace directory
@@ -518,256 +955,2003 @@ void Wad::createFile(const string &path)
             parentEnd = pathVec[i];
     }
 
-    if (!isDirectory(parentPath) || regex_match(parentEnd, mapMarkerRegex))
+    if (!directoryExists(parentPath) || regex_match(parentEnd, mapMarkerRegex))
     {
-        return;
+        return false;
     }
 
-    // All necessary checks complete, create the new directory
-    // Get the names of the end marker of the parent directory
-    parentEnd += "_END";
-
+    // All necessary checks complete, create the new file
     // Open the WAD file
-    fstream wadFile;
-    wadFile.open(fileName, ios::in | ios::out | ios::binary);
-    if (!wadFile.is_open())
+    unique_ptr<iostream> stream = openStream();
+    iostream &wadFile = *stream;
+    if (!wadFile)
     {
         cerr << "Failed to open file: " << fileName << endl;
-        return;
+        return false;
+    }
+
+    // The descriptor goes right before the end marker of the parent directory
+    Node *parentNode = nodesMap[parentPath];
+    int64_t insertIndex = findInsertIndex(parentNode);
+    if (insertIndex == -1) // Parent end marker not found
+    {
+        return false;
+    }
+
+    // Create a new file node
+    Node *newFile = new Node(0, 0, path);
+    parentNode->children.push_back(newFile);
+    addToIndex(path, newFile);
+
+    // Add the descriptor to the list and write everything from it onwards
+    makeRoomForDescriptors(wadFile, 1);
+    Descriptor descriptor = {0, 0, 0, name, newFile};
+    insertDescriptors(insertIndex, {descriptor});
+    writeDescriptors(wadFile, insertIndex, descriptors.size());
+
+    wadFile.flush();
+    return true;
+}
+
+int64_t Wad::writeToFile(const string &path, const char *buffer, int64_t length, int64_t)
+{
+    // Lumps are written whole, so the offset isn't used
+    if (readOnly)
+        return -1;
+
+    uint64_t ticket = 0;
+    int64_t written;
+    {
+        unique_lock<shared_mutex> lock(treeMutex);
+        written = storeLump(path, buffer, length);
+        if (written > 0)
+            ticket = ++writeSequence;
+    }
+    if (!commit(ticket))
+    {
+        return -1; // stored, but the durability mode promised more than we could deliver
     }
+    return written;
+}
 
-    // Update number of descriptors
-    numDescriptors++;
-    wadFile.seekg(4, ios::beg);
-    wadFile.write(reinterpret_cast<char *>(&numDescriptors), sizeof(numDescriptors));
+int64_t Wad::storeLump(const string &path, const char *buffer, int64_t length)
+{
+    Node *parent = parentDirectory(path);
+    if (parent != nullptr && !parent->materialized)
+    {
+        materialize(parent);
+    }
 
-    // Handle the root directory case
-    if (parentPath == "/")
+    // Check if file exists
+    if (!contentExists(path))
     {
-        // Create a new file node
-        Node *newFile = new Node(0, 0, path);
-        Node *parentNode = nodesMap[parentPath];
-        parentNode->children.push_back(newFile);
-        nodesMap[path] = newFile;
+        return -1;
+    }
 
-        // Write in the new directory information in the end of the descriptor list
-        wadFile.seekg(0, ios::end);
-        uint32_t parentEndPos = wadFile.tellg();
+    // Check if file is empty
+    Node *node = nodesMap[path];
+    if (node->length != 0)
+    {
+        return 0;
+    }
 
-        wadFile.write(reinterpret_cast<char *>(&newFile->offset), 4);
-        wadFile.write(reinterpret_cast<char *>(&newFile->length), 4);
-        wadFile.write(name.c_str(), 8);
+    // Open the WAD file
+    unique_ptr<iostream> stream = openStream();
+    iostream &wadFile = *stream;
+    if (!wadFile)
+    {
+        cerr << "Failed to open WAD file: " << fileName << endl;
+        return -1;
+    }
 
-        wadFile.close();
-        return;
+    // In compressed mode the payload stored in the WAD is the chunked container, not the raw bytes.
+    // The container uses 32-bit sizes, so lumps of 4 GB and up are always stored raw.
+    int64_t logicalLength = length;
+    vector<char> container;
+    if (length > 0 && length <= UINT32_MAX && (compressWrites || (length >= 4 && memcmp(buffer, chunkMagic, 4) == 0)))
+    {
+        container = compressLump(buffer, length, defaultChunkSize);
+        buffer = container.data();
+        length = container.size();
     }
 
-    // Start reading from the file descriptor list
-    wadFile.seekg(descriptorOffset, ios::beg);
-    streampos parentEndPos = -1;
-    char buffer[16];
-    vector<string> currDirVec;
+    int64_t descriptorIndex = findDescriptorIndex(node);
+    if (descriptorIndex == -1)
+    {
+        return -1;
+    }
 
-    while (wadFile.read(buffer, sizeof(buffer)) || wadFile.gcount() > 0)
+    // If an identical lump is already stored, point the descriptor at it instead of storing another copy.
+    // Without dedup the write isn't hashed at all.
+    uint64_t hash = dedupWrites ? hashBytes(buffer, length) : 0;
+    LumpLocation duplicate;
+    if (dedupWrites && findDuplicate(hash, buffer, length, duplicate))
     {
-        size_t bytesRead = wadFile.gcount();
+        node->offset = duplicate.offset;
+        node->length = duplicate.length;
+        node->shard = duplicate.shard;
 
-        // Extract the name and trim it
-        string nameInBuffer = string(buffer + 8, 8);
+        updateDescriptor(descriptorIndex, node);
+        writeDescriptors(wadFile, descriptorIndex, descriptorIndex + 1);
+        wadFile.flush();
 
-        // Trim spaces and null characters
-        nameInBuffer.erase(0, nameInBuffer.find_first_not_of(' '));                                     // Trim leading spaces
-        nameInBuffer.erase(nameInBuffer.find_last_not_of(' ') + 1);                                     // Trim trailing spaces
-        nameInBuffer.erase(remove(nameInBuffer.begin(), nameInBuffer.end(), '\0'), nameInBuffer.end()); // Remove null characters
+        dedupReport.lumpsDeduplicated++;
+        dedupReport.bytesSaved += length;
+        return logicalLength;
+    }
 
-        if (regex_match(nameInBuffer, startRegex))
+    if (extended && shardSize > 0 && !inMemory)
+    {
+        // Sharded: append the data to the newest shard file, the descriptor table stays put
+        if (!writeToShard(node, buffer, length))
+        {
+            return -1;
+        }
+        updateDescriptor(descriptorIndex, node);
+        writeDescriptors(wadFile, descriptorIndex, descriptorIndex + 1);
+    }
+    else
+    {
+        uint64_t dataStart;
+        if (journaled())
         {
-            string name;
-            name = nameInBuffer.substr(0, nameInBuffer.size() - 6); // Remove "_START"
-            currDirVec.push_back(name);
+            // Never overwrite the committed table: append the data, the next commit rewrites the table
+            wadFile.seekp(0, ios::end);
+            dataStart = wadFile.tellp();
         }
-        else if (regex_match(nameInBuffer, endRegex))
+        else
         {
-            if (nameInBuffer != parentEnd)
-            {
-                currDirVec.pop_back();
-            }
+            // The new lump data goes where the descriptor table starts, and the table moves up behind it
+            ensureTableAtEnd(wadFile);
+            dataStart = descriptorOffset;
         }
 
-        // Check if the name matches the parent end marker
-        if (bytesRead >= 8 && nameInBuffer == parentEnd) // check for end of parent directory
+        if (!extended && dataStart + length + numDescriptors * descriptorSize() > UINT32_MAX)
         {
-            string currDir = "/";
-            for (auto i : currDirVec)
-            {
-                currDir += i + "/";
-            }
+            cerr << "Write would grow the WAD past 4 GB, convert it to the extended format first" << endl;
+            return -1;
+        }
 
-            if (parentPath == currDir) // check ENTIRE path
-            {
-                parentEndPos = wadFile.tellg();
-                parentEndPos -= 16; // Adjust to the start of the current buffer
-                break;
-            }
-            else
-            {
-                currDirVec.pop_back();
-            }
+        node->length = length;
+        node->offset = dataStart;
+        node->shard = 0;
+        if (!journaled())
+        {
+            descriptorOffset += length;
         }
+
+        // Write data from the buffer to the new lump data section
+        wadFile.seekp(node->offset, ios::beg);
+        wadFile.write(buffer, length);
+
+        updateDescriptor(descriptorIndex, node);
+        writeDescriptors(wadFile, 0, descriptors.size());
     }
 
-    if (parentEndPos == -1) // Parent end marker not found
+    // Remember the payload so later identical writes can share it
+    if (dedupWrites)
     {
-        wadFile.close();
-        return;
+        contentIndex.insert({hash, {node->offset, node->length, node->shard}});
+    }
+    if (checksumsEnabled)
+    {
+        recordChecksum(node, buffer);
     }
 
-    shiftDataForward(wadFile, parentEndPos, 16);
-
-    // Create a new file node
-    Node *newFile = new Node(0, 0, path);
-    Node *parentNode = nodesMap[parentPath];
-    parentNode->children.push_back(newFile);
-    nodesMap[path] = newFile;
-
-    // Write the new descriptor at the shifted position
-    wadFile.seekp(parentEndPos, ios::beg);
-    wadFile.write(reinterpret_cast<char *>(&newFile->offset), 4);
-    wadFile.write(reinterpret_cast<char *>(&newFile->length), 4);
-    wadFile.write(name.c_str(), 8);
-
+    // Clean up and return
     wadFile.flush();
-    wadFile.close();
+    return logicalLength;
 }
 
-int Wad::writeToFile(const string &path, const char *buffer, int length, int offset)
+bool Wad::writeToShard(Node *node, const char *buffer, uint64_t length)
 {
-    // Check if file exists
-    if (!isContent(path))
+    // Shard 0 holds the header and descriptor table, new data always goes to a separate shard
+    uint32_t shard = numShards - 1;
+    uint64_t shardEnd = 0;
+    if (shard > 0)
     {
-        return -1;
+        ifstream shardFile(shardPath(shard), ios::binary | ios::ate);
+        shardEnd = shardFile ? uint64_t(shardFile.tellg()) : 0;
     }
 
-    // Check if file is empty
-    Node *node = nodesMap[path];
-    if (node->length != 0)
+    // Start a new shard when the current one would grow past the limit
+    if (shard == 0 || (shardEnd > 0 && shardEnd + length > shardSize))
     {
-        return 0;
+        shard = numShards++;
+        shardEnd = 0;
+        ofstream create(shardPath(shard), ios::binary | ios::app);
     }
 
-    // Open the WAD file
-    fstream wadFile(fileName, ios::in | ios::out | ios::binary);
-    if (!wadFile.is_open())
+    fstream shardFile(shardPath(shard), ios::in | ios::out | ios::binary);
+    if (!shardFile)
     {
-        cerr << "Failed to open WAD file: " << fileName << endl;
-        return -1;
+        cerr << "Failed to open shard: " << shardPath(shard) << endl;
+        return false;
     }
 
-    // Shift the file descriptor forward, making space for new lump data
-    shiftDataForward(wadFile, descriptorOffset, length);
-    uint32_t newLumpStart = descriptorOffset;
-    descriptorOffset += length;
-
-    // Update the WAD header to reflect the new descriptor offset
-    wadFile.seekp(8, ios::beg);
-    wadFile.write(reinterpret_cast<char *>(&descriptorOffset), 4);
+    shardFile.seekp(shardEnd, ios::beg);
+    shardFile.write(buffer, length);
+    shardFile.flush();
+    if (!shardFile)
+    {
+        return false;
+    }
+    dirtyShards.insert(shard); // fsynced by the next commit
 
+    node->offset = shardEnd;
     node->length = length;
-    node->offset = newLumpStart;
-
-    // Write data from the buffer to the new lump data section
-    wadFile.seekp(node->offset, ios::beg); // Use correct offset for lump data
-    wadFile.write(buffer, length);
-
-    // Find descriptor index for the given file
-    int descriptorIndex = findDescriptorIndex(path);
-
-    wadFile.seekp(descriptorOffset + (descriptorIndex * 16), ios::beg);
-    wadFile.write(reinterpret_cast<char *>(&node->offset), 4);
-    wadFile.write(reinterpret_cast<char *>(&node->length), 4);
-
-    // Clean up and return
-    wadFile.close();
-    return length;
+    node->shard = shard;
+    return true;
 }
 
-vector<string> Wad::tokenizePath(const string &path)
+bool Wad::convertToExtended()
 {
-    vector<string> tokens;
-    stringstream ss(path);
-    string token;
+    if (readOnly)
+        return extended;
 
-    // Split by '/' delimiter
-    while (getline(ss, token, '/'))
+    uint64_t ticket = 0;
+    bool converted;
     {
-        if (!token.empty())
-        {
-            tokens.push_back(token);
-        }
+        unique_lock<shared_mutex> lock(treeMutex);
+        converted = rewriteExtended();
+        if (converted)
+            ticket = ++writeSequence;
     }
-    return tokens;
+    commit(ticket);
+    return converted;
 }
 
-int Wad::findDescriptorIndex(const string &path)
+bool Wad::rewriteExtended()
 {
-    vector<string> tokens = tokenizePath(path);
-    string fName = tokens.back(); // get the file name
+    if (extended)
+    {
+        return true;
+    }
 
-    fstream wadFile(fileName, ios::binary | ios::in);
+    unique_ptr<iostream> stream = openStream();
+    iostream &wadFile = *stream;
     if (!wadFile)
     {
-        throw runtime_error("Failed to open WAD file.");
+        cerr << "Failed to open WAD file: " << fileName << endl;
+        return false;
     }
 
-    // Seek to the start of the descriptor list
-    wadFile.seekg(descriptorOffset, ios::beg);
+    // The 12 byte header keeps its size, so lump data is untouched; only the table is rewritten wider
+    extended = true;
+    memcpy(magic, extendedMagic, 5);
+    makeRoomForDescriptors(wadFile, 0);
+    writeDescriptors(wadFile, 0, descriptors.size());
+    wadFile.flush();
+    return bool(wadFile);
+}
 
-    // Variables for tracking directory hierarchy
-    vector<string> currPathVec;
-    regex startRegex(".*_START$");
-    regex endRegex(".*_END$");
+bool Wad::isExtended() const
+{
+    return extended;
+}
 
-    for (uint32_t i = 0; i < numDescriptors; ++i)
-    {
-        char name[9] = {0};  // WAD names are 8 characters, null-terminated
-        uint32_t offset = 0; // Offset to the data
-        uint32_t size = 0;   // Size of the data
+uint32_t Wad::getNumShards() const
+{
+    return numShards;
+}
 
-        wadFile.read(reinterpret_cast<char *>(&offset), sizeof(offset));
-        wadFile.read(reinterpret_cast<char *>(&size), sizeof(size));
-        wadFile.read(name, 8); // Read the name (8 bytes)
+uint64_t Wad::descriptorSize() const
+{
+    return descriptorSize(extended);
+}
 
-        string nameStr(name, 8);
-        nameStr.erase(0, nameStr.find_first_not_of(' ')); // Trim leading spaces
-        nameStr.erase(nameStr.find_last_not_of(' ') + 1); // Trim trailing spaces
-        nameStr.erase(remove(nameStr.begin(), nameStr.end(), '\0'), nameStr.end());
+uint64_t Wad::descriptorSize(bool extended)
+{
+    return extended ? 32 : 16;
+}
 
-        if (regex_match(nameStr, startRegex))
-        {
-            string currName = nameStr.substr(0, nameStr.size() - 6); // Remove "_START"
-            currPathVec.push_back(currName);
-        }
-        else if (regex_match(nameStr, endRegex))
-        {
-            currPathVec.pop_back();
-        }
+uint64_t Wad::tableStart() const
+{
+    // The extended format keeps the descriptor count and shard count in front of the table
+    return extended ? descriptorOffset + 16 : descriptorOffset;
+}
 
-        if (nameStr == fName) // compare file name
-        {
-            // Compare the full path
-            string currPath = "/";
-            for (const auto &dir : currPathVec)
-            {
-                currPath += dir + "/";
-            }
-            currPath += nameStr;
+void Wad::decodeDescriptor(const char *raw, Descriptor &descriptor) const
+{
+    char name[9] = {0};
+    if (extended)
+    {
+        memcpy(&descriptor.offset, raw, 8);
+        memcpy(&descriptor.length, raw + 8, 8);
+        memcpy(&descriptor.shard, raw + 16, 4);
+        memcpy(name, raw + 24, 8);
+    }
+    else
+    {
+        uint32_t offset;
+        uint32_t length;
+        memcpy(&offset, raw, 4);
+        memcpy(&length, raw + 4, 4);
+        memcpy(name, raw + 8, 8);
+        descriptor.offset = offset;
+        descriptor.length = length;
+        descriptor.shard = 0;
+    }
+    descriptor.name = name;
+    descriptor.node = nullptr;
+}
 
-            if (path == currPath) // Match the entire path
-            {
-                return i;
-            }
-        }
+void Wad::encodeDescriptor(const Descriptor &descriptor, bool extended, char *raw)
+{
+    // Names are stored as exactly 8 bytes, padded with null characters
+    memset(raw, 0, descriptorSize(extended));
+    if (extended)
+    {
+        memcpy(raw, &descriptor.offset, 8);
+        memcpy(raw + 8, &descriptor.length, 8);
+        memcpy(raw + 16, &descriptor.shard, 4);
+        memcpy(raw + 24, descriptor.name.c_str(), min<size_t>(descriptor.name.size(), 8));
+    }
+    else
+    {
+        uint32_t offset = descriptor.offset;
+        uint32_t length = descriptor.length;
+        memcpy(raw, &offset, 4);
+        memcpy(raw + 4, &length, 4);
+        memcpy(raw + 8, descriptor.name.c_str(), min<size_t>(descriptor.name.size(), 8));
     }
+}
 
-    return -1; // Descriptor not found
+vector<char> Wad::encodeHeader(const char *magic, bool extended, uint64_t numDescriptors, uint64_t descriptorOffset)
+{
+    vector<char> header(12, 0);
+    memcpy(header.data(), magic, 4);
+
+    if (extended)
+    {
+        memcpy(header.data() + 4, &descriptorOffset, 8);
+    }
+    else
+    {
+        uint32_t count = numDescriptors;
+        uint32_t offset = descriptorOffset;
+        memcpy(header.data() + 4, &count, 4);
+        memcpy(header.data() + 8, &offset, 4);
+    }
+    return header;
+}
+
+vector<char> Wad::encodeTablePrefix(uint64_t numDescriptors, uint32_t numShards)
+{
+    // Extended format only: descriptor count, shard count and 4 reserved bytes
+    vector<char> prefix(16, 0);
+    memcpy(prefix.data(), &numDescriptors, 8);
+    memcpy(prefix.data() + 8, &numShards, 4);
+    return prefix;
+}
+
+void Wad::writeHeader(ostream &wadFile)
+{
+    if (journaled())
+    {
+        tableDirty = true; // written out by the next commit, through the redo log
+        return;
+    }
+
+    vector<char> header = encodeHeader(magic, extended, numDescriptors, descriptorOffset);
+    wadFile.seekp(0, ios::beg);
+    wadFile.write(header.data(), header.size());
+
+    if (extended)
+    {
+        vector<char> prefix = encodeTablePrefix(numDescriptors, numShards);
+        wadFile.seekp(descriptorOffset, ios::beg);
+        wadFile.write(prefix.data(), prefix.size());
+    }
+}
+
+void Wad::writeDescriptors(ostream &wadFile, uint64_t from, uint64_t to)
+{
+    if (journaled())
+    {
+        tableDirty = true; // written out by the next commit, through the redo log
+        return;
+    }
+
+    // Encode the range into one buffer so it goes out in a single write
+    vector<char> table((to - from) * descriptorSize());
+    for (uint64_t i = from; i < to; i++)
+    {
+        encodeDescriptor(descriptors[i], extended, table.data() + (i - from) * descriptorSize());
+    }
+
+    wadFile.seekp(tableStart() + from * descriptorSize(), ios::beg);
+    wadFile.write(table.data(), table.size());
+    writeHeader(wadFile);
+}
+
+void Wad::ensureTableAtEnd(iostream &wadFile)
+{
+    if (tableAtEnd)
+    {
+        return;
+    }
+
+    // Lump data follows the table, so move the table to the end of the file where it can grow
+    wadFile.seekg(0, ios::end);
+    descriptorOffset = wadFile.tellg();
+    writeDescriptors(wadFile, 0, descriptors.size());
+    tableAtEnd = true;
+}
+
+void Wad::makeRoomForDescriptors(iostream &wadFile, uint64_t extra)
+{
+    if (!journaled())
+    {
+        ensureTableAtEnd(wadFile);
+        return;
+    }
+
+    uint64_t needed = (tableStart() - descriptorOffset) + (descriptors.size() + extra) * descriptorSize();
+    if (needed <= tableCapacity)
+    {
+        return;
+    }
+
+    // Reserve a bigger region at the end of the file. The old region is left alone because the
+    // committed header still points at it; the next commit switches over to the new one.
+    wadFile.seekp(0, ios::end);
+    descriptorOffset = wadFile.tellp();
+    tableCapacity = needed * 2;
+    vector<char> zeros(tableCapacity, 0);
+    wadFile.write(zeros.data(), zeros.size());
+    tableDirty = true;
+}
+
+void Wad::updateDescriptor(uint64_t index, Node *node)
+{
+    descriptors[index].offset = node->offset;
+    descriptors[index].length = node->length;
+    descriptors[index].shard = node->shard;
+}
+
+int64_t Wad::findInsertIndex(Node *parent)
+{
+    // Entries for the root directory go at the end of the descriptor list
+    if (parent == nodesMap["/"])
+    {
+        return descriptors.size();
+    }
+
+    // Otherwise the parent's range ends with its matching _END marker
+    int64_t start = findDescriptorIndex(parent);
+    if (start == -1 || !endsWith(descriptors[start].name, "_START") || rangeEnds[start] == openRange)
+    {
+        return -1;
+    }
+    return rangeEnds[start] - 1;
+}
+
+string Wad::shardPath(uint32_t shard) const
+{
+    return fileName + "." + to_string(shard);
+}
+
+unique_ptr<iostream> Wad::openShard(uint32_t shard)
+{
+    if (shard == 0)
+    {
+        return openStream();
+    }
+    return unique_ptr<iostream>(new fstream(shardPath(shard), ios::in | ios::out | ios::binary));
+}
+
+bool Wad::readLump(vector<unique_ptr<iostream>> &streams, Node *node, uint64_t offset, char *buffer, uint64_t length)
+{
+    return readStored(streams, node->shard, node->offset + offset, buffer, length);
+}
+
+bool Wad::readStored(vector<unique_ptr<iostream>> &streams, uint32_t shard, uint64_t position, char *buffer, uint64_t length)
+{
+    // Streams are opened lazily, one per shard, so a caller can reuse them across reads
+    if (streams.size() <= shard)
+    {
+        streams.resize(shard + 1);
+    }
+    if (!streams[shard])
+    {
+        streams[shard] = openShard(shard);
+    }
+
+    iostream &file = *streams[shard];
+    file.clear();
+    file.seekg(position, ios::beg);
+    file.read(buffer, length);
+    return bool(file);
+}
+
+void Wad::addToIndex(const string &path, Node *node)
+{
+    nodesMap[path] = node;
+
+    size_t footprint = nodeFootprint(path);
+    numNodes++;
+    nodeBytes += footprint;
+    if (path.back() == '/')
+        numDirectories++;
+    else
+        lumpBytes += footprint;
+
+    // Index by lump name so name queries don't have to walk every path.
+    // A lazy tree answers those from the descriptor table instead, see find.
+    vector<string> tokens = tokenizePath(path);
+    if (!tokens.empty() && !lazyTree)
+    {
+        nameIndex.insert({tokens.back(), node});
+    }
+}
+
+size_t Wad::nodeFootprint(const string &path) const
+{
+    // The Node, its nodesMap (and nameIndex) entries, its descriptorIndex entry, and the heap copies
+    // of the path once it no longer fits the small string buffer
+    size_t entry = 32 + sizeof(string) + sizeof(Node *); // red-black tree node plus key and value
+    size_t indexEntry = 32 + sizeof(Node *);             // hash node plus its bucket
+    size_t pathHeap = path.size() > 15 ? path.size() + 1 : 0;
+    return sizeof(Node) + pathHeap + indexEntry + (lazyTree ? 1 : 2) * (entry + pathHeap);
+}
+
+bool Wad::endsWith(const string &name, const string &suffix)
+{
+    return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool Wad::isMapMarker(const string &name)
+{
+    return name.size() == 4 && name[0] == 'E' && isdigit(name[1]) && name[2] == 'M' && isdigit(name[3]);
+}
+
+uint64_t Wad::entryEnd(uint64_t index)
+{
+    // One past the last descriptor of the entry, see buildRanges
+    return min<uint64_t>(rangeEnds[index], descriptors.size());
+}
+
+vector<pair<uint64_t, bool>> Wad::directoryEntries(Node *dir)
+{
+    // Descriptor index of every entry directly inside dir, in file order, and whether it is a directory
+    vector<pair<uint64_t, bool>> entries;
+    Node *root = nodesMap["/"];
+    uint64_t i = 0;
+
+    if (dir != root)
+    {
+        int64_t start = findDescriptorIndex(dir);
+        if (start == -1)
+        {
+            return entries;
+        }
+        if (!endsWith(descriptors[start].name, "_START")) // map marker
+        {
+            uint64_t end = entryEnd(start);
+            for (uint64_t j = start + 1; j < end; j++)
+            {
+                entries.push_back({j, false});
+            }
+            return entries;
+        }
+        i = start + 1;
+    }
+
+    while (i < descriptors.size())
+    {
+        const string &name = descriptors[i].name;
+        if (endsWith(name, "_END"))
+        {
+            if (dir != root)
+                break; // end of this namespace
+            i++;       // stray end marker at the top level, buildNodes ignores those too
+            continue;
+        }
+
+        entries.push_back({i, endsWith(name, "_START") || isMapMarker(name)});
+        i = entryEnd(i);
+    }
+    return entries;
+}
+
+void Wad::walkLumps(const function<void(Node *, uint64_t)> &visit)
+{
+    // One pass over the table with the same grammar as buildNodes, visiting every lump with its directory
+    stack<Node *> dirs;
+    dirs.push(nodesMap["/"]);
+    for (uint64_t i = 0; i < descriptors.size(); i++)
+    {
+        const string &name = descriptors[i].name;
+        if (endsWith(name, "_START"))
+        {
+            dirs.push(descriptors[i].node);
+        }
+        else if (endsWith(name, "_END"))
+        {
+            if (dirs.size() > 1)
+                dirs.pop();
+        }
+        else if (isMapMarker(name))
+        {
+            uint64_t end = entryEnd(i);
+            for (uint64_t j = i + 1; j < end; j++)
+            {
+                visit(descriptors[i].node, j);
+            }
+            i = end - 1;
+        }
+        else
+        {
+            visit(dirs.top(), i);
+        }
+    }
+}
+
+void Wad::materialize(Node *dir)
+{
+    if (dir->materialized)
+    {
+        return;
+    }
+
+    // Rebuild the children in file order, subdirectories are always built so only lumps are new
+    vector<Node *> children;
+    for (auto &entry : directoryEntries(dir))
+    {
+        Descriptor &descriptor = descriptors[entry.first];
+        Node *child = descriptor.node;
+        if (child == nullptr)
+        {
+            child = newNode(entry.first, dir->name + descriptor.name);
+            addToIndex(child->name, child);
+        }
+        children.push_back(child);
+    }
+    dir->children = move(children);
+    dir->materialized = true;
+    materializations++;
+
+    {
+        lock_guard<mutex> lock(residentMutex);
+        residentDirectories.push_front(dir);
+        residentIndex[dir] = residentDirectories.begin();
+    }
+
+    // Drop the coldest directories until the lump nodes fit the budget, never the one just built
+    while (treeMemoryBudget > 0 && lumpBytes > treeMemoryBudget && residentDirectories.size() > 1)
+    {
+        evict(residentDirectories.back());
+    }
+}
+
+void Wad::evict(Node *dir)
+{
+    // Only the subdirectories stay
+    vector<Node *> subdirs;
+    for (Node *child : dir->children)
+    {
+        if (child->name.back() == '/')
+            subdirs.push_back(child);
+    }
+    dir->children = move(subdirs);
+
+    for (auto &entry : directoryEntries(dir))
+    {
+        Descriptor &descriptor = descriptors[entry.first];
+        if (entry.second || descriptor.node == nullptr)
+        {
+            continue;
+        }
+
+        Node *lump = descriptor.node;
+        size_t footprint = nodeFootprint(lump->name);
+        nodesMap.erase(lump->name);
+        descriptorIndex.erase(lump);
+        numNodes--;
+        nodeBytes -= footprint;
+        lumpBytes -= footprint;
+        descriptor.node = nullptr;
+        delete lump;
+    }
+
+    dir->materialized = false;
+    evictions++;
+
+    lock_guard<mutex> lock(residentMutex);
+    residentDirectories.erase(residentIndex[dir]);
+    residentIndex.erase(dir);
+}
+
+void Wad::touchDirectory(Node *dir)
+{
+    lock_guard<mutex> lock(residentMutex);
+    auto it = residentIndex.find(dir);
+    if (it != residentIndex.end())
+    {
+        residentDirectories.splice(residentDirectories.begin(), residentDirectories, it->second); // mark as most recently used
+    }
+}
+
+Node *Wad::parentDirectory(const string &path)
+{
+    if (path.empty() || path[0] != '/')
+    {
+        return nullptr;
+    }
+
+    string p = path;
+    if (p.size() > 1 && p.back() == '/')
+    {
+        p.pop_back();
+    }
+    auto it = nodesMap.find(p.substr(0, p.find_last_of('/') + 1));
+    return it == nodesMap.end() ? nullptr : it->second;
+}
+
+void Wad::makeResident(Node *dir, shared_lock<shared_mutex> &lock)
+{
+    if (!lazyTree || dir == nullptr)
+    {
+        return;
+    }
+
+    // Building a directory changes the maps, so it needs the lock exclusively for a moment.
+    // Another thread's materialize can evict dir again before we get the shared lock back, hence the loop.
+    while (!dir->materialized)
+    {
+        lock.unlock();
+        {
+            unique_lock<shared_mutex> exclusive(treeMutex);
+            materialize(dir);
+        }
+        lock.lock();
+    }
+    touchDirectory(dir);
+}
+
+TreeMemoryUsage Wad::getMemoryUsage()
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+
+    TreeMemoryUsage usage;
+    usage.nodes = numNodes;
+    usage.nodeBytes = nodeBytes;
+    usage.tableBytes = descriptors.capacity() * sizeof(Descriptor);
+    usage.directories = numDirectories;
+    usage.materializations = materializations;
+    usage.evictions = evictions;
+    if (lazyTree)
+    {
+        lock_guard<mutex> residentLock(residentMutex);
+        usage.residentDirectories = residentIndex.size();
+    }
+    else
+    {
+        usage.residentDirectories = numDirectories;
+    }
+    return usage;
+}
+
+int Wad::find(const string &pattern, vector<string> *matches)
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+
+    if (pattern.empty())
+    {
+        return -1;
+    }
+
+    // Everything before the first wildcard is a literal prefix we can seek to
+    string prefix = pattern.substr(0, pattern.find_first_of("*?["));
+    int numMatches = 0;
+
+    if (lazyTree) // most lumps aren't built, so match against the descriptor table instead
+    {
+        bool byPath = pattern[0] == '/';
+        vector<pair<string, string>> found; // sort key, path
+        auto consider = [&](const string &path, const string &name)
+        {
+            string p = path;
+            if (p.size() > 1 && p.back() == '/')
+                p.pop_back();
+            if (byPath ? fnmatch(pattern.c_str(), p.c_str(), FNM_PATHNAME) == 0 : fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+                found.push_back({byPath ? path : name, path});
+        };
+
+        for (auto &entry : nodesMap)
+        {
+            if (entry.first.back() == '/' && entry.first != "/")
+                consider(entry.first, tokenizePath(entry.first).back());
+        }
+        walkLumps([&](Node *dir, uint64_t index)
+        {
+            const string &name = descriptors[index].name;
+            if (!byPath || dir->name.compare(0, prefix.size(), prefix, 0, min(prefix.size(), dir->name.size())) == 0)
+                consider(dir->name + name, name);
+        });
+
+        // Same order as the indexes give: by path, or by name
+        stable_sort(found.begin(), found.end(), [](const pair<string, string> &a, const pair<string, string> &b)
+                    { return a.first < b.first; });
+        for (auto &match : found)
+        {
+            matches->push_back(match.second);
+        }
+        return found.size();
+    }
+
+    if (pattern[0] == '/') // match against full paths, '*' does not cross '/'
+    {
+        for (auto it = nodesMap.lower_bound(prefix); it != nodesMap.end(); ++it)
+        {
+            if (it->first.compare(0, prefix.size(), prefix) != 0)
+                break; // past the last path sharing the prefix
+
+            string p = it->first;
+            if (p.size() > 1 && p.back() == '/')
+                p.pop_back(); // directories are stored with a trailing '/'
+
+            if (p != "/" && fnmatch(pattern.c_str(), p.c_str(), FNM_PATHNAME) == 0)
+            {
+                matches->push_back(it->first);
+                ++numMatches;
+            }
+        }
+    }
+    else // match against lump names anywhere in the tree
+    {
+        for (auto it = nameIndex.lower_bound(prefix); it != nameIndex.end(); ++it)
+        {
+            if (it->first.compare(0, prefix.size(), prefix) != 0)
+                break;
+
+            if (fnmatch(pattern.c_str(), it->first.c_str(), 0) == 0)
+            {
+                matches->push_back(it->second->name);
+                ++numMatches;
+            }
+        }
+    }
+
+    return numMatches;
+}
+
+uint64_t Wad::hashBytes(const char *data, size_t length)
+{
+    // Non-cryptographic 64-bit hash that consumes 8 bytes per step (multiply/xor-shift mixing)
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t hash = length * prime;
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word *= 0xBF58476D1CE4E5B9ULL;
+        word ^= word >> 31;
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void Wad::hashContents(unsigned numThreads)
+{
+    // Collect the stored payloads from the table, so lumps a lazy tree hasn't built are covered too
+    vector<LumpLocation> lumps;
+    for (const Descriptor &descriptor : descriptors)
+    {
+        if (descriptor.length > 0)
+        {
+            lumps.push_back({descriptor.offset, descriptor.length, descriptor.shard});
+        }
+    }
+    vector<uint64_t> hashes(lumps.size());
+
+    if (numThreads == 0)
+    {
+        numThreads = max(1u, thread::hardware_concurrency());
+    }
+    numThreads = min<size_t>(numThreads, max<size_t>(lumps.size(), 1));
+
+    // Each thread hashes a strided share of the lumps through its own streams
+    vector<thread> workers;
+    for (unsigned t = 0; t < numThreads; t++)
+    {
+        workers.emplace_back([this, &lumps, &hashes, t, numThreads]()
+        {
+            vector<unique_ptr<iostream>> streams;
+            vector<char> data;
+            for (size_t i = t; i < lumps.size(); i += numThreads)
+            {
+                const LumpLocation &lump = lumps[i];
+                data.resize(lump.length);
+                readStored(streams, lump.shard, lump.offset, data.data(), lump.length);
+                hashes[i] = hashBytes(data.data(), lump.length);
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    contentIndex.clear();
+    dedupWrites = true;
+    for (size_t i = 0; i < lumps.size(); i++)
+    {
+        contentIndex.insert({hashes[i], lumps[i]});
+    }
+}
+
+bool Wad::findDuplicate(uint64_t hash, const char *buffer, uint64_t length, LumpLocation &duplicate)
+{
+    auto range = contentIndex.equal_range(hash);
+    vector<unique_ptr<iostream>> streams;
+    vector<char> existing;
+
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const LumpLocation &candidate = it->second;
+        if (candidate.length != length)
+            continue;
+
+        // Hashes can collide, so confirm the bytes really match
+        existing.resize(length);
+        if (readStored(streams, candidate.shard, candidate.offset, existing.data(), length) && memcmp(existing.data(), buffer, length) == 0)
+        {
+            duplicate = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+vector<char> Wad::compressLump(const char *data, uint32_t length, uint32_t chunkSize)
+{
+    // Layout: magic, logical size, chunk size, chunk count, (count + 1) chunk offsets, compressed chunks.
+    // Offsets are relative to the start of the lump, chunk i spans offsets[i] to offsets[i + 1].
+    uint32_t numChunks = (length + chunkSize - 1) / chunkSize;
+    uint32_t headerSize = 16 + 4 * (numChunks + 1);
+
+    vector<char> container(headerSize);
+    memcpy(container.data(), chunkMagic, 4);
+    memcpy(container.data() + 4, &length, 4);
+    memcpy(container.data() + 8, &chunkSize, 4);
+    memcpy(container.data() + 12, &numChunks, 4);
+
+    vector<uint32_t> offsets;
+    offsets.push_back(headerSize);
+    for (uint32_t i = 0; i < numChunks; i++)
+    {
+        uLong chunkLength = min(chunkSize, length - i * chunkSize);
+        uLongf compressedLength = compressBound(chunkLength);
+
+        size_t start = container.size();
+        container.resize(start + compressedLength);
+        compress2(reinterpret_cast<Bytef *>(container.data() + start), &compressedLength,
+                  reinterpret_cast<const Bytef *>(data + i * chunkSize), chunkLength, Z_DEFAULT_COMPRESSION);
+        container.resize(start + compressedLength);
+        offsets.push_back(container.size());
+    }
+
+    memcpy(container.data() + 16, offsets.data(), 4 * offsets.size());
+    return container;
+}
+
+bool Wad::parseChunkHeader(const char *header, uint64_t storedLength, ChunkTable &chunks, uint32_t &numChunks)
+{
+    if (storedLength < 16 || memcmp(header, chunkMagic, 4) != 0)
+    {
+        return false;
+    }
+
+    memcpy(&chunks.logicalSize, header + 4, 4);
+    memcpy(&chunks.chunkSize, header + 8, 4);
+    memcpy(&numChunks, header + 12, 4);
+
+    // Sanity check so a raw lump that happens to start with the magic isn't misread
+    return chunks.chunkSize != 0 && numChunks == (uint64_t(chunks.logicalSize) + chunks.chunkSize - 1) / chunks.chunkSize &&
+           16 + 4 * (uint64_t(numChunks) + 1) <= storedLength;
+}
+
+bool Wad::chunkOffsetsValid(const ChunkTable &chunks, uint64_t storedLength)
+{
+    // Chunks follow the offset table in order and end inside the lump
+    uint64_t previous = 16 + 4 * uint64_t(chunks.offsets.size());
+    for (uint32_t offset : chunks.offsets)
+    {
+        if (offset < previous || offset > storedLength)
+        {
+            return false;
+        }
+        previous = offset;
+    }
+    return true;
+}
+
+bool Wad::unpackLump(const char *stored, uint64_t storedLength, vector<char> &out)
+{
+    ChunkTable chunks;
+    uint32_t numChunks;
+    if (!parseChunkHeader(stored, storedLength, chunks, numChunks))
+    {
+        return false; // stored raw
+    }
+
+    chunks.offsets.resize(numChunks + 1);
+    memcpy(chunks.offsets.data(), stored + 16, 4 * (numChunks + 1));
+    if (!chunkOffsetsValid(chunks, storedLength))
+    {
+        return false;
+    }
+
+    out.resize(chunks.logicalSize);
+    for (uint32_t i = 0; i < numChunks; i++)
+    {
+        uLongf outLength = min(chunks.chunkSize, chunks.logicalSize - i * chunks.chunkSize);
+        if (uncompress(reinterpret_cast<Bytef *>(out.data() + uint64_t(i) * chunks.chunkSize), &outLength,
+                       reinterpret_cast<const Bytef *>(stored + chunks.offsets[i]), chunks.offsets[i + 1] - chunks.offsets[i]) != Z_OK)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+ChunkTable *Wad::getChunkTable(Node *node)
+{
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        if (node->probed)
+        {
+            return node->chunks.get();
+        }
+    }
+
+    // Probe without cacheMutex, so other readers and the cache budget aren't held up by the read.
+    // Two readers may both probe the same lump, the first to finish records the result.
+    shared_ptr<ChunkTable> chunks;
+    if (node->length >= 16)
+    {
+        // Look for the container header at the start of the lump
+        vector<unique_ptr<iostream>> streams;
+        char header[16];
+        auto table = make_shared<ChunkTable>();
+        uint32_t numChunks;
+        if (readLump(streams, node, 0, header, 16) && parseChunkHeader(header, node->length, *table, numChunks))
+        {
+            table->offsets.resize(numChunks + 1);
+            if (readLump(streams, node, 16, reinterpret_cast<char *>(table->offsets.data()), 4 * (numChunks + 1)) &&
+                chunkOffsetsValid(*table, node->length))
+            {
+                chunks = table;
+            }
+        }
+    }
+
+    lock_guard<mutex> lock(cacheMutex);
+    if (!node->probed)
+    {
+        node->probed = true;
+        node->chunks = chunks;
+    }
+    return node->chunks.get();
+}
+
+int64_t Wad::readCompressed(Node *node, ChunkTable *chunks, char *buffer, int64_t length, int64_t offset)
+{
+    if (offset >= chunks->logicalSize)
+    {
+        return 0;
+    }
+
+    int64_t readLength = min<int64_t>(length, chunks->logicalSize - offset);
+    uint32_t firstChunk = offset / chunks->chunkSize;
+    uint32_t lastChunk = (offset + readLength - 1) / chunks->chunkSize;
+
+    // Only the chunks overlapping the requested range are decompressed
+    vector<unique_ptr<iostream>> streams;
+    vector<char> compressed;
+    vector<char> chunk;
+    int64_t copied = 0;
+
+    for (uint32_t i = firstChunk; i <= lastChunk; i++)
+    {
+        // Cache key: position of the chunk, with the shard number in the top byte
+        uint64_t chunkPos = (uint64_t(node->shard) << 56) | (node->offset + chunks->offsets[i]);
+        uint32_t chunkLength = min(chunks->chunkSize, chunks->logicalSize - i * chunks->chunkSize);
+
+        if (!lookupChunk(chunkPos, chunk))
+        {
+            // The table was checked when it was loaded, but a bad chunk must never reach inflate
+            if (chunks->offsets[i + 1] < chunks->offsets[i] || chunks->offsets[i + 1] > node->length)
+            {
+                cerr << "Corrupt chunk table in: " << node->name << endl;
+                return -1;
+            }
+            compressed.resize(chunks->offsets[i + 1] - chunks->offsets[i]);
+            if (!readLump(streams, node, chunks->offsets[i], compressed.data(), compressed.size()))
+            {
+                cerr << "Short read of a compressed chunk in: " << node->name << endl;
+                return -1;
+            }
+
+            chunk.resize(chunkLength);
+            uLongf outLength = chunkLength;
+            if (uncompress(reinterpret_cast<Bytef *>(chunk.data()), &outLength,
+                           reinterpret_cast<const Bytef *>(compressed.data()), compressed.size()) != Z_OK ||
+                outLength != chunkLength)
+            {
+                cerr << "Corrupt compressed chunk in: " << node->name << endl;
+                return -1;
+            }
+            storeChunk(chunkPos, chunk);
+        }
+
+        // Copy the overlapping part of this chunk
+        uint32_t chunkStart = i * chunks->chunkSize;
+        uint32_t from = max<int64_t>(offset, chunkStart) - chunkStart;
+        uint32_t to = min<int64_t>(offset + readLength, chunkStart + chunkLength) - chunkStart;
+        memcpy(buffer + copied, chunk.data() + from, to - from);
+        copied += to - from;
+    }
+
+    return copied;
+}
+
+bool Wad::lookupChunk(uint64_t chunkPos, vector<char> &chunk)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    auto it = chunkCacheIndex.find(chunkPos);
+    if (it == chunkCacheIndex.end())
+    {
+        cacheStats.misses++;
+        return false;
+    }
+
+    cacheStats.hits++;
+    chunkCache.splice(chunkCache.begin(), chunkCache, it->second); // mark as most recently used
+    it->second->lastUse = cacheBudget ? ++cacheBudget->clock : 0;
+    chunk = it->second->data;
+    return true;
+}
+
+void Wad::storeChunk(uint64_t chunkPos, const vector<char> &chunk)
+{
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        size_t limit = cacheBudget ? cacheBudget->getLimit() : chunkCacheLimit;
+        if (chunk.size() > limit || chunkCacheIndex.count(chunkPos))
+        {
+            return;
+        }
+
+        chunkCache.push_front({chunkPos, cacheBudget ? ++cacheBudget->clock : 0, chunk});
+        chunkCacheIndex[chunkPos] = chunkCache.begin();
+        chunkCacheBytes += chunk.size();
+
+        if (!cacheBudget)
+        {
+            // Evict least recently used chunks until we're back under the limit
+            while (chunkCacheBytes > chunkCacheLimit)
+            {
+                dropOldestChunk();
+            }
+            return;
+        }
+        cacheBudget->used += chunk.size();
+    }
+
+    // The budget locks other members' caches, so ours has to be released first
+    cacheBudget->trim();
+}
+
+void Wad::dropOldestChunk()
+{
+    size_t size = chunkCache.back().data.size();
+    chunkCacheBytes -= size;
+    if (cacheBudget)
+    {
+        cacheBudget->used -= size;
+    }
+    chunkCacheIndex.erase(chunkCache.back().position);
+    chunkCache.pop_back();
+    cacheStats.evictions++;
+}
+
+CacheStats Wad::getCacheStats()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    CacheStats stats = cacheStats;
+    stats.bytes = chunkCacheBytes;
+    return stats;
+}
+
+CacheBudget::CacheBudget(size_t limit) : limit(limit)
+{
+}
+
+size_t CacheBudget::getLimit() const
+{
+    return limit;
+}
+
+size_t CacheBudget::getUsed() const
+{
+    return used;
+}
+
+void CacheBudget::setLimit(size_t bytes)
+{
+    limit = bytes;
+    trim();
+}
+
+void CacheBudget::add(Wad *wad)
+{
+    lock_guard<mutex> lock(membersMutex);
+    members.insert(wad);
+}
+
+void CacheBudget::remove(Wad *wad)
+{
+    lock_guard<mutex> lock(membersMutex);
+    members.erase(wad);
+    lock_guard<mutex> cacheLock(wad->cacheMutex);
+    used -= wad->chunkCacheBytes;
+}
+
+void CacheBudget::trim()
+{
+    lock_guard<mutex> lock(membersMutex);
+    while (used > limit)
+    {
+        // Each member's cache is ordered by use, so the oldest chunk overall is at the back of one of them
+        Wad *oldest = nullptr;
+        uint64_t oldestUse = UINT64_MAX;
+        for (Wad *wad : members)
+        {
+            lock_guard<mutex> cacheLock(wad->cacheMutex);
+            if (!wad->chunkCache.empty() && wad->chunkCache.back().lastUse < oldestUse)
+            {
+                oldest = wad;
+                oldestUse = wad->chunkCache.back().lastUse;
+            }
+        }
+        if (oldest == nullptr)
+        {
+            return;
+        }
+
+        lock_guard<mutex> cacheLock(oldest->cacheMutex);
+        if (!oldest->chunkCache.empty())
+        {
+            oldest->dropOldestChunk();
+        }
+    }
+}
+
+int Wad::getLumps(vector<LumpInfo> *lumps)
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+
+    int numLumps = 0;
+    if (lazyTree) // straight from the table, listing shouldn't build every directory
+    {
+        walkLumps([&](Node *dir, uint64_t index)
+        {
+            const Descriptor &descriptor = descriptors[index];
+            lumps->push_back({dir->name + descriptor.name, descriptor.offset, descriptor.length, descriptor.shard});
+            ++numLumps;
+        });
+        return numLumps;
+    }
+
+    for (auto &entry : nodesMap)
+    {
+        if (entry.first.back() != '/')
+        {
+            Node *node = entry.second;
+            lumps->push_back({entry.first, node->offset, node->length, node->shard});
+            ++numLumps;
+        }
+    }
+    return numLumps;
+}
+
+int64_t Wad::readRaw(uint32_t shard, uint64_t offset, char *buffer, uint64_t length)
+{
+    shared_lock<shared_mutex> lock(treeMutex);
+
+    unique_ptr<iostream> stream = openShard(shard);
+    if (!*stream)
+    {
+        return -1;
+    }
+    stream->seekg(offset, ios::beg);
+    stream->read(buffer, length);
+    return stream->gcount();
+}
+
+bool Wad::journaled() const
+{
+    return durability != Durability::None && !inMemory;
+}
+
+bool Wad::commit(uint64_t ticket)
+{
+    // Only group commit makes callers wait; periodic mode leaves it to the sync thread
+    if (ticket == 0 || durability != Durability::GroupCommit || inMemory)
+    {
+        return true;
+    }
+    return waitDurable(ticket);
+}
+
+bool Wad::waitDurable(uint64_t ticket)
+{
+    unique_lock<mutex> lock(commitMutex);
+    while (durableSequence < ticket)
+    {
+        if (commitInProgress)
+        {
+            // Someone else is already syncing; wait and see whether their commit covered us
+            commitDone.wait(lock);
+            continue;
+        }
+
+        // Become the leader: one round of fsyncs covers every write made before the table snapshot
+        commitInProgress = true;
+        lock.unlock();
+        bool ok;
+        uint64_t covered = flushJournal(ok);
+        lock.lock();
+        commitInProgress = false;
+        if (ok)
+        {
+            durableSequence = max(durableSequence, covered);
+        }
+        commitDone.notify_all();
+        if (!ok)
+        {
+            return false; // waiters it would have covered retry as leaders and see their own result
+        }
+    }
+    return true;
+}
+
+bool Wad::sync()
+{
+    if (journaled())
+    {
+        uint64_t ticket;
+        {
+            shared_lock<shared_mutex> lock(treeMutex);
+            ticket = writeSequence;
+        }
+        return waitDurable(ticket);
+    }
+
+    bool ok = true;
+    if (!inMemory)
+    {
+        ok = syncFile(fileName);
+        for (uint32_t shard = 1; shard < numShards; shard++)
+        {
+            ok = syncFile(shardPath(shard)) && ok;
+        }
+    }
+    return ok;
+}
+
+void Wad::syncLoop()
+{
+    unique_lock<mutex> lock(commitMutex);
+    while (!stopSync)
+    {
+        syncWake.wait_for(lock, chrono::milliseconds(syncIntervalMs));
+        if (stopSync)
+        {
+            break;
+        }
+
+        lock.unlock();
+        uint64_t ticket;
+        {
+            shared_lock<shared_mutex> treeLock(treeMutex);
+            ticket = writeSequence;
+        }
+        waitDurable(ticket);
+        lock.lock();
+    }
+}
+
+uint64_t Wad::flushJournal(bool &ok)
+{
+    // Snapshot what needs to go out while holding the tree lock, then do the slow part without it
+    vector<pair<uint64_t, vector<char>>> ranges;
+    vector<uint32_t> shards;
+    uint64_t covered;
+    {
+        unique_lock<shared_mutex> lock(treeMutex);
+        covered = writeSequence;
+        shards.assign(dirtyShards.begin(), dirtyShards.end());
+        dirtyShards.clear();
+
+        if (tableDirty)
+        {
+            ranges.push_back({0, encodeHeader(magic, extended, numDescriptors, descriptorOffset)});
+
+            vector<char> table;
+            if (extended)
+            {
+                table = encodeTablePrefix(numDescriptors, numShards);
+            }
+            size_t start = table.size();
+            table.resize(start + descriptors.size() * descriptorSize());
+            for (uint64_t i = 0; i < descriptors.size(); i++)
+            {
+                encodeDescriptor(descriptors[i], extended, table.data() + start + i * descriptorSize());
+            }
+            ranges.push_back({descriptorOffset, move(table)});
+            tableDirty = false;
+        }
+    }
+
+    // Lump data has to be on disk before a table that points at it
+    ok = syncFile(fileName);
+    for (uint32_t shard : shards)
+    {
+        ok = syncFile(shardPath(shard)) && ok;
+    }
+    if (checksumsEnabled)
+    {
+        syncFile(checksumPath()); // best effort, a lump without a checksum is only reported as unchecked
+    }
+
+    if (!ranges.empty())
+    {
+        // Log the new header and table first so a crash halfway through the in place update can be redone
+        ok = ok && writeJournal(ranges) && applyJournal(ranges);
+        // Only a log whose update fully landed may be dropped, otherwise the next load redoes it
+        ok = ok && truncate(journalPath().c_str(), 0) == 0;
+    }
+
+    if (!ok)
+    {
+        cerr << "Failed to sync: " << fileName << endl;
+
+        // Put back what this round took, so the next commit tries all of it again
+        unique_lock<shared_mutex> lock(treeMutex);
+        dirtyShards.insert(shards.begin(), shards.end());
+        tableDirty = tableDirty || !ranges.empty();
+    }
+    return covered;
+}
+
+string Wad::journalPath() const
+{
+    return fileName + ".redo";
+}
+
+bool Wad::syncFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool Wad::writeJournal(const vector<pair<uint64_t, vector<char>>> &ranges)
+{
+    // Layout: magic, uint32 range count, per range (uint64 position, uint64 length, bytes), uint64 hash of all of it
+    vector<char> record(journalMagic, journalMagic + 4);
+    uint32_t numRanges = ranges.size();
+    record.insert(record.end(), reinterpret_cast<char *>(&numRanges), reinterpret_cast<char *>(&numRanges) + 4);
+    for (const auto &range : ranges)
+    {
+        uint64_t position = range.first;
+        uint64_t length = range.second.size();
+        record.insert(record.end(), reinterpret_cast<char *>(&position), reinterpret_cast<char *>(&position) + 8);
+        record.insert(record.end(), reinterpret_cast<char *>(&length), reinterpret_cast<char *>(&length) + 8);
+        record.insert(record.end(), range.second.begin(), range.second.end());
+    }
+    uint64_t hash = hashBytes(record.data(), record.size());
+    record.insert(record.end(), reinterpret_cast<char *>(&hash), reinterpret_cast<char *>(&hash) + 8);
+
+    ofstream journal(journalPath(), ios::binary | ios::trunc);
+    journal.write(record.data(), record.size());
+    journal.close();
+    return journal.good() && syncFile(journalPath());
+}
+
+bool Wad::applyJournal(const vector<pair<uint64_t, vector<char>>> &ranges)
+{
+    fstream wadFile(fileName, ios::in | ios::out | ios::binary);
+    if (!wadFile)
+    {
+        return false;
+    }
+    for (const auto &range : ranges)
+    {
+        wadFile.seekp(range.first, ios::beg);
+        wadFile.write(range.second.data(), range.second.size());
+    }
+    wadFile.close();
+    return wadFile.good() && syncFile(fileName);
+}
+
+void Wad::recoverJournal()
+{
+    ifstream journal(journalPath(), ios::binary);
+    if (!journal)
+    {
+        return;
+    }
+    vector<char> record((istreambuf_iterator<char>(journal)), istreambuf_iterator<char>());
+    journal.close();
+
+    // A torn record never made it past the log, so the WAD itself is still consistent
+    if (record.size() < 16 || memcmp(record.data(), journalMagic, 4) != 0)
+    {
+        return;
+    }
+    uint64_t hash;
+    memcpy(&hash, record.data() + record.size() - 8, 8);
+    if (hash != hashBytes(record.data(), record.size() - 8))
+    {
+        return;
+    }
+
+    vector<pair<uint64_t, vector<char>>> ranges;
+    uint32_t numRanges;
+    memcpy(&numRanges, record.data() + 4, 4);
+    size_t pos = 8;
+    for (uint32_t i = 0; i < numRanges && pos + 16 <= record.size() - 8; i++)
+    {
+        uint64_t position;
+        uint64_t length;
+        memcpy(&position, record.data() + pos, 8);
+        memcpy(&length, record.data() + pos + 8, 8);
+        pos += 16;
+        if (length > record.size() - 8 - pos)
+        {
+            return;
+        }
+        ranges.push_back({position, vector<char>(record.begin() + pos, record.begin() + pos + length)});
+        pos += length;
+    }
+
+    // A log that can't be applied and dropped would be replayed over later changes, so refuse to load
+    if (!applyJournal(ranges) || truncate(journalPath().c_str(), 0) != 0)
+    {
+        throw runtime_error("Failed to replay the redo log: " + journalPath());
+    }
+}
+
+uint32_t Wad::crc32c(const char *data, size_t length, uint32_t crc)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware)
+    {
+        return ~crc32cHardware(~crc, data, length);
+    }
+#endif
+    return ~crc32cSoftware(~crc, data, length);
+}
+
+string Wad::checksumPath() const
+{
+    return fileName + ".crc";
+}
+
+void Wad::loadChecksums()
+{
+    lock_guard<mutex> lock(checksumMutex);
+    checksumsLoaded = true;
+    if (inMemory)
+    {
+        return;
+    }
+
+    ifstream sidecar(checksumPath(), ios::binary);
+    if (!sidecar)
+    {
+        return;
+    }
+    vector<char> data((istreambuf_iterator<char>(sidecar)), istreambuf_iterator<char>());
+    if (data.size() < 4 || memcmp(data.data(), checksumMagic, 4) != 0)
+    {
+        cerr << "Ignoring unrecognised checksum file: " << checksumPath() << endl;
+        return;
+    }
+
+    // A torn record at the end from an interrupted append is dropped
+    for (size_t pos = 4; pos + 24 <= data.size(); pos += 24)
+    {
+        uint32_t shard;
+        uint32_t crc;
+        uint64_t offset;
+        uint64_t length;
+        memcpy(&shard, data.data() + pos, 4);
+        memcpy(&crc, data.data() + pos + 4, 4);
+        memcpy(&offset, data.data() + pos + 8, 8);
+        memcpy(&length, data.data() + pos + 16, 8);
+        checksums[make_tuple(shard, offset, length)] = {crc, 0};
+    }
+}
+
+void Wad::recordChecksum(Node *node, const char *stored)
+{
+    uint32_t crc = crc32c(stored, node->length);
+
+    lock_guard<mutex> lock(checksumMutex);
+    checksums[make_tuple(node->shard, node->offset, node->length)] = {crc, 1};
+    if (inMemory)
+    {
+        return;
+    }
+
+    ofstream sidecar(checksumPath(), ios::binary | ios::app);
+    sidecar.seekp(0, ios::end);
+    if (sidecar.tellp() == 0)
+    {
+        sidecar.write(checksumMagic, 4);
+    }
+
+    char record[24];
+    memcpy(record, &node->shard, 4);
+    memcpy(record + 4, &crc, 4);
+    memcpy(record + 8, &node->offset, 8);
+    memcpy(record + 16, &node->length, 8);
+    sidecar.write(record, sizeof(record));
+    if (!sidecar)
+    {
+        cerr << "Failed to write checksum file: " << checksumPath() << endl;
+    }
+}
+
+bool Wad::crcStored(vector<unique_ptr<iostream>> &streams, const LumpLocation &payload, vector<char> &piece, uint32_t &crc)
+{
+    // In pieces, so a multi-gigabyte lump doesn't need a buffer as big as itself
+    crc = 0;
+    piece.resize(min<uint64_t>(payload.length, checksumPieceSize));
+    for (uint64_t done = 0; done < payload.length;)
+    {
+        uint64_t n = min<uint64_t>(payload.length - done, piece.size());
+        if (!readStored(streams, payload.shard, payload.offset + done, piece.data(), n))
+        {
+            return false;
+        }
+        crc = crc32c(piece.data(), n, crc);
+        done += n;
+    }
+    return true;
+}
+
+bool Wad::verifyLump(Node *node)
+{
+    auto key = make_tuple(node->shard, node->offset, node->length);
+    uint32_t expected;
+    {
+        lock_guard<mutex> lock(checksumMutex);
+        auto it = checksums.find(key);
+        if (it == checksums.end())
+        {
+            return true; // nothing to check against
+        }
+        if (it->second.verified != 0)
+        {
+            return it->second.verified > 0;
+        }
+        expected = it->second.crc;
+    }
+
+    // Two readers may race to check the same lump, they both get the same answer
+    vector<unique_ptr<iostream>> streams;
+    vector<char> piece;
+    uint32_t crc;
+    bool ok = crcStored(streams, {node->offset, node->length, node->shard}, piece, crc) && crc == expected;
+
+    lock_guard<mutex> lock(checksumMutex);
+    auto it = checksums.find(key);
+    if (it != checksums.end())
+    {
+        it->second.verified = ok ? 1 : -1;
+    }
+    if (!ok)
+    {
+        cerr << "Checksum mismatch in: " << node->name << endl;
+    }
+    return ok;
+}
+
+void Wad::checksumPayloads(const vector<LumpLocation> &payloads, vector<uint32_t> &crcs, vector<uint8_t> &readable, unsigned numThreads)
+{
+    crcs.assign(payloads.size(), 0);
+    readable.assign(payloads.size(), 0);
+    if (numThreads == 0)
+    {
+        numThreads = max(1u, thread::hardware_concurrency());
+    }
+    numThreads = min<size_t>(numThreads, max<size_t>(payloads.size(), 1));
+
+    // The payloads are sorted by position. Each thread takes a contiguous run holding about the same
+    // number of bytes, so every thread reads its part of the file front to back.
+    uint64_t totalBytes = 0;
+    for (const LumpLocation &payload : payloads)
+    {
+        totalBytes += payload.length;
+    }
+    vector<size_t> bounds = {0};
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < payloads.size() && bounds.size() < numThreads; i++)
+    {
+        bytes += payloads[i].length;
+        if (bytes >= totalBytes / numThreads * bounds.size())
+        {
+            bounds.push_back(i + 1);
+        }
+    }
+    bounds.push_back(payloads.size());
+
+    vector<thread> workers;
+    for (size_t t = 0; t + 1 < bounds.size(); t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            vector<unique_ptr<iostream>> streams;
+            vector<char> piece;
+            for (size_t i = bounds[t]; i < bounds[t + 1]; i++)
+            {
+                readable[i] = crcStored(streams, payloads[i], piece, crcs[i]);
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+int64_t Wad::buildChecksums(unsigned numThreads)
+{
+    if (readOnly) // the sidecar belongs to the live WAD
+    {
+        return -1;
+    }
+
+    // Payloads never move once written, so only an in-memory WAD (whose buffer can be reallocated) needs the lock
+    shared_lock<shared_mutex> bufferLock(treeMutex, defer_lock);
+    vector<LumpInfo> lumps;
+    getLumps(&lumps);
+    if (inMemory)
+    {
+        bufferLock.lock();
+    }
+
+    // One entry per stored payload, deduplicated lumps share theirs
+    vector<LumpLocation> payloads;
+    for (const LumpInfo &lump : lumps)
+    {
+        if (lump.length > 0)
+        {
+            payloads.push_back({lump.offset, lump.length, lump.shard});
+        }
+    }
+    sort(payloads.begin(), payloads.end(), [](const LumpLocation &a, const LumpLocation &b)
+         { return tie(a.shard, a.offset, a.length) < tie(b.shard, b.offset, b.length); });
+    payloads.erase(unique(payloads.begin(), payloads.end(), [](const LumpLocation &a, const LumpLocation &b)
+                          { return a.shard == b.shard && a.offset == b.offset && a.length == b.length; }),
+                   payloads.end());
+
+    vector<uint32_t> crcs;
+    vector<uint8_t> readable;
+    checksumPayloads(payloads, crcs, readable, numThreads);
+
+    map<tuple<uint32_t, uint64_t, uint64_t>, LumpChecksum> fresh;
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        if (!readable[i])
+        {
+            cerr << "Failed to read lump data at offset " << payloads[i].offset << " in shard " << payloads[i].shard << endl;
+            continue;
+        }
+        fresh[make_tuple(payloads[i].shard, payloads[i].offset, payloads[i].length)] = {crcs[i], 1};
+    }
+
+    lock_guard<mutex> lock(checksumMutex);
+    fresh.insert(checksums.begin(), checksums.end()); // keeps checksums recorded by writes made meanwhile
+
+    if (!inMemory)
+    {
+        // Written aside and renamed over the old sidecar, so a crash leaves one or the other
+        string tempPath = checksumPath() + ".tmp";
+        ofstream sidecar(tempPath, ios::binary | ios::trunc);
+        sidecar.write(checksumMagic, 4);
+        for (auto &entry : fresh)
+        {
+            char record[24];
+            memcpy(record, &get<0>(entry.first), 4);
+            memcpy(record + 4, &entry.second.crc, 4);
+            memcpy(record + 8, &get<1>(entry.first), 8);
+            memcpy(record + 16, &get<2>(entry.first), 8);
+            sidecar.write(record, sizeof(record));
+        }
+        sidecar.close();
+        if (!sidecar || !syncFile(tempPath) || rename(tempPath.c_str(), checksumPath().c_str()) != 0)
+        {
+            cerr << "Failed to write checksum file: " << checksumPath() << endl;
+            return -1;
+        }
+    }
+
+    checksums = move(fresh);
+    checksumsLoaded = true;
+    return checksums.size();
+}
+
+ScrubReport Wad::scrub(unsigned numThreads)
+{
+    if (!checksumsLoaded)
+    {
+        loadChecksums();
+    }
+
+    shared_lock<shared_mutex> bufferLock(treeMutex, defer_lock); // see buildChecksums
+    vector<LumpInfo> lumps;
+    getLumps(&lumps);
+    if (inMemory)
+    {
+        bufferLock.lock();
+    }
+    sort(lumps.begin(), lumps.end(), [](const LumpInfo &a, const LumpInfo &b)
+         { return tie(a.shard, a.offset, a.length) < tie(b.shard, b.offset, b.length); });
+
+    // Lumps sharing a payload through dedup are checked with one read
+    ScrubReport report;
+    vector<LumpLocation> payloads;
+    vector<uint32_t> expected;
+    vector<vector<string>> owners;
+    {
+        lock_guard<mutex> lock(checksumMutex);
+        for (const LumpInfo &lump : lumps)
+        {
+            if (lump.length == 0)
+            {
+                continue; // nothing stored
+            }
+            if (!payloads.empty() && payloads.back().shard == lump.shard && payloads.back().offset == lump.offset &&
+                payloads.back().length == lump.length)
+            {
+                owners.back().push_back(lump.path);
+                continue;
+            }
+
+            auto it = checksums.find(make_tuple(lump.shard, lump.offset, lump.length));
+            if (it == checksums.end())
+            {
+                report.lumpsUnchecked++;
+                continue;
+            }
+            payloads.push_back({lump.offset, lump.length, lump.shard});
+            expected.push_back(it->second.crc);
+            owners.push_back({lump.path});
+        }
+    }
+
+    vector<uint32_t> crcs;
+    vector<uint8_t> readable;
+    checksumPayloads(payloads, crcs, readable, numThreads);
+
+    lock_guard<mutex> lock(checksumMutex);
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        bool ok = readable[i] && crcs[i] == expected[i];
+        auto it = checksums.find(make_tuple(payloads[i].shard, payloads[i].offset, payloads[i].length));
+        if (it != checksums.end())
+        {
+            it->second.verified = ok ? 1 : -1; // verify-on-read can skip these now
+        }
+
+        report.lumpsChecked += owners[i].size();
+        report.bytesChecked += payloads[i].length;
+        if (!ok)
+        {
+            report.corrupt.insert(report.corrupt.end(), owners[i].begin(), owners[i].end());
+        }
+    }
+    return report;
+}
+
+bool Wad::createSnapshot(const string &name)
+{
+    if (readOnly || inMemory || name.empty() || name.find('/') != string::npos)
+    {
+        return false;
+    }
+
+    // Writers wait only for the table copy; building the view happens after the lock is released
+    vector<Descriptor> table;
+    {
+        shared_lock<shared_mutex> lock(treeMutex);
+        table = descriptors;
+    }
+    shared_ptr<Wad> view(new Wad(*this, move(table)));
+
+    lock_guard<mutex> lock(snapshotMutex);
+    return snapshots.insert({name, view}).second;
+}
+
+shared_ptr<Wad> Wad::getSnapshot(const string &name)
+{
+    lock_guard<mutex> lock(snapshotMutex);
+    auto it = snapshots.find(name);
+    return it == snapshots.end() ? nullptr : it->second;
+}
+
+int Wad::getSnapshots(vector<string> *names)
+{
+    lock_guard<mutex> lock(snapshotMutex);
+    for (auto &entry : snapshots)
+    {
+        names->push_back(entry.first);
+    }
+    return snapshots.size();
+}
+
+bool Wad::dropSnapshot(const string &name)
+{
+    lock_guard<mutex> lock(snapshotMutex);
+    return snapshots.erase(name) > 0;
+}
+
+bool Wad::isReadOnly() const
+{
+    return readOnly;
+}
+
+DedupReport Wad::getDedupReport() const
+{
+    return dedupReport;
+}
+
+vector<string> Wad::tokenizePath(const string &path)
+{
+    vector<string> tokens;
+    stringstream ss(path);
+    string token;
+
+    // Split by '/' delimiter
+    while (getline(ss, token, '/'))
+    {
+        if (!token.empty())
+        {
+            tokens.push_back(token);
+        }
+    }
+    return tokens;
+}
+
+int64_t Wad::findDescriptorIndex(Node *node)
+{
+    auto it = descriptorIndex.find(node);
+    if (it == descriptorIndex.end())
+    {
+        return -1; // Descriptor not found
+    }
+    return it->second;
 }
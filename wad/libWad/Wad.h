@@ -3,42 +3,358 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <set>
+#include <memory>
+#include <functional>
+#include <tuple>
+#include <cstdint>
+#include <atomic>
 
 using namespace std;
 
+// Chunk offset table of a lump stored in the compressed container format
+struct ChunkTable
+{
+    uint32_t logicalSize; // size of the uncompressed lump
+    uint32_t chunkSize;   // uncompressed bytes per chunk
+    vector<uint32_t> offsets; // chunk i is stored at offsets[i] to offsets[i + 1], relative to the lump
+};
+
+// A decompressed chunk in the cache
+struct CachedChunk
+{
+    uint64_t position; // cache key, see readCompressed
+    uint64_t lastUse;  // tick of the shared budget's clock, 0 without one
+    vector<char> data;
+};
+
 struct Node
 {
-    uint32_t offset;
-    uint32_t length;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t shard; // which file holds the data, 0 is the WAD itself
     string name;
     vector<Node *> children;
-    Node(uint32_t offset, uint32_t length, string name);
+    shared_ptr<ChunkTable> chunks; // set if the lump is stored compressed
+    bool probed;                   // whether the lump has been checked for the compressed format
+    bool materialized;             // directories: whether the lump children exist, only ever false in lazy mode
+    Node(uint64_t offset, uint64_t length, string name);
     ~Node();
 };
 
+// One entry of the descriptor table, kept in memory in file order.
+// Classic WADs ("IWAD"/"PWAD"): 12 byte header (magic, uint32 count, uint32 table offset) and
+// 16 byte descriptors (uint32 offset, uint32 length, 8 byte name).
+// Extended WADs ("XWAD"): 12 byte header (magic, uint64 table offset); the table starts with
+// uint64 count, uint32 shard count, 4 reserved bytes, followed by 32 byte descriptors
+// (uint64 offset, uint64 length, uint32 shard, 4 reserved bytes, 8 byte name).
+struct Descriptor
+{
+    uint64_t offset;
+    uint64_t length;
+    uint32_t shard;
+    string name;
+    Node *node; // node built from this descriptor, nullptr for _END markers
+};
+
+// A stored payload, all the dedup index needs to find and compare it
+struct LumpLocation
+{
+    uint64_t offset;
+    uint64_t length;
+    uint32_t shard;
+};
+
+// Where a lump's stored bytes live, for tools that read the WAD in on-disk order
+struct LumpInfo
+{
+    string path;
+    uint64_t offset;
+    uint64_t length; // stored length, a compressed lump is smaller than getSize reports
+    uint32_t shard;
+};
+
+// CRC32C of a stored payload. The "<wad>.crc" sidecar holds "WCRC" followed by 24 byte records
+// (uint32 shard, uint32 crc, uint64 offset, uint64 length), appended as lumps are written; later records win.
+struct LumpChecksum
+{
+    uint32_t crc;
+    int verified; // 0 not checked since load, 1 matched, -1 mismatched
+};
+
+// Result of Wad::scrub
+struct ScrubReport
+{
+    uint64_t lumpsChecked = 0;   // lumps whose stored bytes were read back and compared with their checksum
+    uint64_t bytesChecked = 0;   // payloads shared by deduplicated lumps are read and counted once
+    uint64_t lumpsUnchecked = 0; // lumps the sidecar has no checksum for
+    vector<string> corrupt;      // paths whose stored bytes no longer match their checksum
+};
+
+// How writes reach the disk. Periodic and group commit keep header/table updates in a redo log
+// ("<wad>.redo") so a crash never leaves them half written.
+enum class Durability
+{
+    None,       // write straight into the WAD, never fsync
+    Periodic,   // a background thread commits every syncIntervalMs
+    GroupCommit // writers wait for a commit, concurrent writers share one round of fsyncs
+};
+
+class Wad;
+
+// Byte limit shared by the chunk caches of several Wads, see LoadOptions::cacheBudget. When the
+// members hold too much, whichever one has the least recently used chunk gives it up, so busy
+// WADs get the room idle ones aren't using.
+class CacheBudget
+{
+    friend class Wad;
+    mutex membersMutex; // never taken while a member's cacheMutex is held
+    set<Wad *> members;
+    atomic<size_t> limit;
+    atomic<size_t> used{0};
+    atomic<uint64_t> clock{0}; // orders chunk uses across the members
+    void add(Wad *wad);    // helper function
+    void remove(Wad *wad); // helper function
+    void trim();           // helper function
+public:
+    CacheBudget(size_t limit);
+    size_t getLimit() const;
+    size_t getUsed() const;
+    void setLimit(size_t bytes); // evicts right away if the members are over the new limit
+};
+
+// Counters of the decompressed chunk cache, see Wad::getCacheStats
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0; // held by this Wad, shared budgets count each member separately
+};
+
+struct LoadOptions
+{
+    bool hashContents = false; // hash every lump up front so writes can dedup against existing data
+    unsigned numThreads = 0;   // threads used for hashing, 0 means one per core
+    bool compressWrites = false; // store newly written lumps as compressed chunks
+    size_t chunkCacheSize = 4 << 20; // bytes of decompressed chunks kept in memory
+    bool extendedFormat = false;     // convert a classic WAD to the 64-bit extended format on load
+    uint64_t shardSize = 0;          // extended format: append new lump data to shard files of at most this size, 0 keeps it in the WAD
+    Durability durability = Durability::None;
+    unsigned syncIntervalMs = 1000; // commit interval for Durability::Periodic
+    bool lazyTree = false;          // index only the directories on load, build a directory's lumps on first access
+    size_t treeMemoryBudget = 0;    // lazy tree: bytes of lump nodes kept around before cold directories are dropped, 0 means no limit
+    bool checksums = false;         // load "<wad>.crc" and add a checksum for every lump written
+    bool verifyReads = false;       // check each lump against its checksum on first read, implies checksums
+    shared_ptr<CacheBudget> cacheBudget; // share one chunk cache limit with other Wads, chunkCacheSize is ignored when set
+};
+
+// Approximate heap used by the in-memory tree, see Wad::getMemoryUsage
+struct TreeMemoryUsage
+{
+    uint64_t nodes = 0;               // directory and lump nodes currently built
+    uint64_t nodeBytes = 0;           // estimated bytes held by those nodes and the path maps
+    uint64_t tableBytes = 0;          // bytes held by the in-memory descriptor table
+    uint64_t directories = 0;         // every directory, they are always built
+    uint64_t residentDirectories = 0; // directories whose lumps are built
+    uint64_t materializations = 0;    // lazy tree: directories built on access
+    uint64_t evictions = 0;           // lazy tree: directories whose lumps were dropped to stay in budget
+};
+
+struct DedupReport
+{
+    uint32_t lumpsDeduplicated = 0; // writes that pointed at an existing identical lump
+    uint64_t bytesSaved = 0;        // bytes that were not stored again
+};
+
 class Wad
 {
+    friend class CacheBudget;
     char magic[5];
-    uint32_t numDescriptors;
-    uint32_t descriptorOffset;
+    uint64_t numDescriptors;
+    uint64_t descriptorOffset;
+    bool extended;      // 64-bit extended format, see extendedMagic
+    uint32_t numShards; // extended format: shard 0 is the WAD itself, shard n is stored in "<fileName>.n"
+    uint64_t shardSize = 0;
+    bool tableAtEnd;    // nothing follows the descriptor table, so it can grow in place
+    uint64_t tableCapacity; // bytes reserved on disk for the table (journaled modes grow it by relocating)
+    vector<Descriptor> descriptors;
     string fileName;
+    bool inMemory;                // true when the WAD lives in memBuffer instead of on disk
+    vector<char> memBuffer;       // whole WAD image for the in-memory backend
     map<string, Node *> nodesMap; // to keep track of file paths and their corresponding pointers
+    vector<uint64_t> rangeEnds; // per descriptor, one past the last descriptor of its entry, see buildRanges
+    static constexpr uint64_t openRange = UINT64_MAX; // rangeEnds of a namespace that is never closed
+    unordered_map<Node *, uint64_t> descriptorIndex; // built node -> its descriptor, the root has none
+    multimap<string, Node *> nameIndex; // lump names (last path token), sorted for prefix queries
+    unordered_multimap<uint64_t, LumpLocation> contentIndex; // content hash -> stored payloads, for deduplicating writes
+    DedupReport dedupReport;
+    bool dedupWrites = false; // set by hashContents, writes are only hashed and indexed once it has run
+    bool compressWrites = false;
+    static constexpr char extendedMagic[5] = "XWAD"; // 64-bit header/descriptors, see buildTree
+    static constexpr char chunkMagic[5] = "ZLMP"; // marks a lump stored in the compressed container format
+    static const uint32_t defaultChunkSize = 64 * 1024;
+    mutex cacheMutex; // guards the chunk cache and compression probing
+    list<CachedChunk> chunkCache; // decompressed chunks keyed by file position, most recent first
+    unordered_map<uint64_t, list<CachedChunk>::iterator> chunkCacheIndex;
+    size_t chunkCacheBytes = 0;
+    size_t chunkCacheLimit = 4 << 20;
+    shared_ptr<CacheBudget> cacheBudget; // when set, its limit replaces chunkCacheLimit
+    CacheStats cacheStats;
+    shared_mutex treeMutex; // readers share it, createDirectory/createFile/writeToFile take it exclusively
+    Durability durability = Durability::None;
+    static constexpr char journalMagic[5] = "WRDO";
+    bool tableDirty = false;  // journaled modes: in-memory header/table differ from the committed ones
+    set<uint32_t> dirtyShards; // shards written since the last commit
+    uint64_t writeSequence = 0;   // bumped by every change, under treeMutex
+    uint64_t durableSequence = 0; // every change up to this one is on disk, under commitMutex
+    bool commitInProgress = false;
+    mutex commitMutex;
+    condition_variable commitDone;
+    thread syncThread; // Durability::Periodic only
+    condition_variable syncWake;
+    bool stopSync = false;
+    unsigned syncIntervalMs = 1000;
+    bool lazyTree = false;       // only directories are built on load, see materialize
+    size_t treeMemoryBudget = 0; // lazy tree: limit for lumpBytes, 0 means no limit
+    mutex residentMutex;         // guards residentDirectories, readers touch it under a shared treeMutex
+    list<Node *> residentDirectories; // materialized directories, most recently used first
+    unordered_map<Node *, list<Node *>::iterator> residentIndex;
+    uint64_t numNodes = 0;
+    uint64_t nodeBytes = 0;      // estimate for every built node, see nodeFootprint
+    uint64_t lumpBytes = 0;      // the part of nodeBytes that belongs to lump nodes of materialized directories
+    uint64_t numDirectories = 0;
+    uint64_t materializations = 0;
+    uint64_t evictions = 0;
+    static constexpr char checksumMagic[5] = "WCRC";
+    static constexpr uint64_t checksumPieceSize = 4 << 20; // payloads are read back in pieces this big
+    bool checksumsEnabled = false; // keep the sidecar up to date on writes
+    bool checksumsLoaded = false;
+    bool verifyReads = false;
+    mutex checksumMutex; // guards checksums, reads update the verified state under a shared treeMutex
+    map<tuple<uint32_t, uint64_t, uint64_t>, LumpChecksum> checksums; // (shard, offset, length) of a payload -> its checksum
+    bool readOnly = false; // snapshot views refuse every change
+    mutex snapshotMutex;   // guards snapshots, never held while waiting on treeMutex
+    map<string, shared_ptr<Wad>> snapshots;
 
-    Wad(const string &path);
+    Wad(const string &path, const LoadOptions &options = LoadOptions());
+    Wad(vector<char> &&buffer);
+    Wad(const Wad &source, vector<Descriptor> &&table); // snapshot view
+    void buildTree(istream &file);                   // helper function
+    void buildNodes();                               // helper function
+    Node *newNode(uint64_t index, const string &name);    // helper function
+    void buildRanges();                                   // helper function
+    void insertDescriptors(uint64_t at, const vector<Descriptor> &added); // helper function
+    unique_ptr<iostream> openStream();               // helper function, file or memory backed
     vector<string> tokenizePath(const string &path); // helper function
-    void shiftDataForward(fstream &wadFile, streampos startPos, size_t shiftAmount);   // helper function
-    int findDescriptorIndex(const string &file); //helper function
+    void addToIndex(const string &path, Node *node);      // helper function
+    bool findDuplicate(uint64_t hash, const char *buffer, uint64_t length, LumpLocation &duplicate); // helper function
+    void applyOptions(const LoadOptions &options);                                             // helper function
+    ChunkTable *getChunkTable(Node *node);                                                     // helper function
+    static bool parseChunkHeader(const char *header, uint64_t storedLength, ChunkTable &chunks, uint32_t &numChunks); // helper function
+    static bool chunkOffsetsValid(const ChunkTable &chunks, uint64_t storedLength);                                  // helper function
+    int64_t readCompressed(Node *node, ChunkTable *chunks, char *buffer, int64_t length, int64_t offset); // helper function
+    bool lookupChunk(uint64_t chunkPos, vector<char> &chunk);                                  // helper function
+    void storeChunk(uint64_t chunkPos, const vector<char> &chunk);                             // helper function
+    void dropOldestChunk();                                                                    // helper function, caller holds cacheMutex
+    int64_t findDescriptorIndex(Node *node);   //helper function
+    int64_t findInsertIndex(Node *parent);     // helper function
+    uint64_t descriptorSize() const;           // helper function
+    uint64_t tableStart() const;               // helper function
+    void decodeDescriptor(const char *raw, Descriptor &descriptor) const; // helper function
+    void writeHeader(ostream &wadFile);                                  // helper function
+    void writeDescriptors(ostream &wadFile, uint64_t from, uint64_t to); // helper function
+    void ensureTableAtEnd(iostream &wadFile);                            // helper function
+    void makeRoomForDescriptors(iostream &wadFile, uint64_t extra);      // helper function
+    bool contentExists(const string &path);                              // helper function, caller holds treeMutex
+    bool directoryExists(const string &path);                            // helper function, caller holds treeMutex
+    bool addDirectory(const string &path);                               // helper function
+    bool addFile(const string &path);                                    // helper function
+    int64_t storeLump(const string &path, const char *buffer, int64_t length); // helper function
+    bool rewriteExtended();                                              // helper function
+    bool journaled() const;                                              // helper function
+    bool commit(uint64_t ticket);                                        // helper function
+    bool waitDurable(uint64_t ticket);                                   // helper function
+    void syncLoop();                                                     // helper function
+    uint64_t flushJournal(bool &ok);                                     // helper function
+    string journalPath() const;                                          // helper function
+    static bool syncFile(const string &path);                            // helper function
+    bool writeJournal(const vector<pair<uint64_t, vector<char>>> &ranges); // helper function
+    bool applyJournal(const vector<pair<uint64_t, vector<char>>> &ranges); // helper function
+    void recoverJournal();                                               // helper function
+    void updateDescriptor(uint64_t index, Node *node);                   // helper function
+    bool writeToShard(Node *node, const char *buffer, uint64_t length);  // helper function
+    string shardPath(uint32_t shard) const;                              // helper function
+    unique_ptr<iostream> openShard(uint32_t shard);                      // helper function
+    bool readLump(vector<unique_ptr<iostream>> &streams, Node *node, uint64_t offset, char *buffer, uint64_t length); // helper function
+    bool readStored(vector<unique_ptr<iostream>> &streams, uint32_t shard, uint64_t position, char *buffer, uint64_t length); // helper function
+    static bool endsWith(const string &name, const string &suffix);      // helper function
+    size_t nodeFootprint(const string &path) const;                      // helper function
+    uint64_t entryEnd(uint64_t index);                                   // helper function
+    vector<pair<uint64_t, bool>> directoryEntries(Node *dir);            // helper function
+    void walkLumps(const function<void(Node *, uint64_t)> &visit);      // helper function
+    void materialize(Node *dir);                                         // helper function, caller holds treeMutex exclusively
+    void evict(Node *dir);                                               // helper function, caller holds treeMutex exclusively
+    void touchDirectory(Node *dir);                                      // helper function
+    Node *parentDirectory(const string &path);                           // helper function
+    void makeResident(Node *dir, shared_lock<shared_mutex> &lock);      // helper function
+    string checksumPath() const;                                         // helper function
+    void loadChecksums();                                                // helper function
+    void recordChecksum(Node *node, const char *stored);                 // helper function
+    bool verifyLump(Node *node);                                         // helper function
+    bool crcStored(vector<unique_ptr<iostream>> &streams, const LumpLocation &payload, vector<char> &piece, uint32_t &crc); // helper function
+    void checksumPayloads(const vector<LumpLocation> &payloads, vector<uint32_t> &crcs, vector<uint8_t> &readable, unsigned numThreads); // helper function
 public:
     ~Wad();
     static Wad *loadWad(const string &path);
+    static Wad *loadWad(const string &path, const LoadOptions &options);
+    static Wad *loadWadFromBuffer(const char *data, size_t size); // copies the bytes
+    static Wad *loadWadFromBuffer(vector<char> &&buffer);         // takes ownership, no copy
     string getMagic();
     bool isContent(const string &path);
     bool isDirectory(const string &path);
-    int getSize(const string &path);
-    int getContents(const string &path, char *buffer, int length, int offset = 0);
+    int64_t getSize(const string &path);
+    int64_t getContents(const string &path, char *buffer, int64_t length, int64_t offset = 0);
     int getDirectory(const string &path, vector<string> *directory);
+    int find(const string &pattern, vector<string> *matches); // glob over names ("E1M*") or paths ("/F/F1/FLAT*")
     void createDirectory(const string &path);
     void createFile(const string &path);
-    int writeToFile(const string &path, const char *buffer, int length, int offset = 0);
+    int64_t writeToFile(const string &path, const char *buffer, int64_t length, int64_t offset = 0);
     void printWadStructure() const;
+    bool isInMemory() const;
+    const vector<char> &getBuffer() const; // current image of an in-memory WAD
+    vector<char> releaseBuffer();          // hands the image back, the Wad must not be used afterwards
+    bool flushToFile(const string &path);  // writes the current WAD image to path
+    static uint64_t hashBytes(const char *data, size_t length);
+    static vector<char> compressLump(const char *data, uint32_t length, uint32_t chunkSize);
+    void hashContents(unsigned numThreads = 0); // hashes every lump in parallel and indexes them for dedup
+    DedupReport getDedupReport() const;
+    bool convertToExtended(); // rewrites the header and descriptor table in the 64-bit extended format
+    bool isExtended() const;
+    uint32_t getNumShards() const;
+    bool sync(); // makes every change so far durable, false if a file or the redo log couldn't be written
+    int getLumps(vector<LumpInfo> *lumps);                                      // every content lump with its stored location
+    int64_t readRaw(uint32_t shard, uint64_t offset, char *buffer, uint64_t length); // stored bytes, no decompression
+    static bool unpackLump(const char *stored, uint64_t storedLength, vector<char> &out); // false if the bytes aren't a compressed container
+    static bool isMapMarker(const string &name); // "ExMy", a map owns the 10 descriptors that follow it
+    static uint64_t descriptorSize(bool extended);
+    static void encodeDescriptor(const Descriptor &descriptor, bool extended, char *raw); // fills descriptorSize(extended) bytes
+    static vector<char> encodeHeader(const char *magic, bool extended, uint64_t numDescriptors, uint64_t descriptorOffset);
+    static vector<char> encodeTablePrefix(uint64_t numDescriptors, uint32_t numShards); // extended format only
+    TreeMemoryUsage getMemoryUsage(); // estimated memory held by the tree and the descriptor table
+    CacheStats getCacheStats();
+    bool createSnapshot(const string &name);         // read-only view of the WAD as it is now, false if the name is taken or the WAD is in memory
+    shared_ptr<Wad> getSnapshot(const string &name); // nullptr if there is no such snapshot
+    int getSnapshots(vector<string> *names);
+    bool dropSnapshot(const string &name);           // readers still holding the view can finish with it
+    bool isReadOnly() const;
+    static uint32_t crc32c(const char *data, size_t length, uint32_t crc = 0); // SSE4.2 when the CPU has it, chain calls by passing the previous result
+    int64_t buildChecksums(unsigned numThreads = 0); // checksums every stored payload and rewrites the sidecar, returns how many
+    ScrubReport scrub(unsigned numThreads = 0);      // reads every payload back in parallel and compares it with its checksum
 };
@@ -0,0 +1,196 @@
+#include "../libWad/Wad.h"
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+using namespace std;
+
+static void copyFile(const string &from, const string &to)
+{
+    ifstream in(from, ios::binary);
+    ofstream out(to, ios::binary | ios::trunc);
+    out << in.rdbuf();
+}
+
+// Measures write throughput (createFile + writeToFile pairs) under each durability mode.
+// Every mode runs against a fresh copy of the WAD so the results are comparable.
+static double runMode(const string &wadPath, Durability durability, int numThreads, int opsPerThread, int lumpSize)
+{
+    string copyPath = wadPath + ".bench";
+    copyFile(wadPath, copyPath);
+
+    LoadOptions options;
+    options.durability = durability;
+    options.syncIntervalMs = 100;
+    Wad *wad = Wad::loadWad(copyPath, options);
+    wad->createDirectory("/BN");
+
+    vector<char> data(lumpSize, 'x');
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (int t = 0; t < numThreads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            for (int i = 0; i < opsPerThread; i++)
+            {
+                char name[32];
+                snprintf(name, sizeof(name), "/BN/T%02d%05d", t, i); // 8 character lump names
+                wad->createFile(name);
+                wad->writeToFile(name, data.data(), data.size());
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    delete wad; // includes the final commit for the journaled modes
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    remove(copyPath.c_str());
+    remove((copyPath + ".redo").c_str());
+    return numThreads * opsPerThread / seconds;
+}
+
+// Lumps written by the crash test: thread t's lump i holds 100 + i % 50 bytes of 'a' + t
+static string crashLumpName(int t, int i)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/BN/T%02d%05d", t, i);
+    return name;
+}
+
+// Group commit writers in a child process get kill -9'd at a random point, then the WAD is
+// reloaded (replaying the redo log) and every write the child saw acknowledged has to be there,
+// intact. Returns the number of rounds that failed.
+static int crashTest(const string &wadPath, int rounds, int numThreads)
+{
+    string copyPath = wadPath + ".crash";
+    mt19937 random(random_device{}());
+    int failures = 0;
+
+    for (int round = 0; round < rounds; round++)
+    {
+        copyFile(wadPath, copyPath);
+        remove((copyPath + ".redo").c_str());
+
+        int acks[2];
+        if (pipe(acks) != 0)
+        {
+            cerr << "wadbench: pipe failed" << endl;
+            return rounds;
+        }
+
+        pid_t child = fork();
+        if (child == 0)
+        {
+            close(acks[0]);
+            LoadOptions options;
+            options.durability = Durability::GroupCommit;
+            Wad *wad = Wad::loadWad(copyPath, options);
+            wad->createDirectory("/BN");
+
+            vector<thread> workers;
+            for (int t = 0; t < numThreads; t++)
+            {
+                workers.emplace_back([&, t]()
+                {
+                    for (int i = 0; i < 100000; i++)
+                    {
+                        string name = crashLumpName(t, i);
+                        string data(100 + i % 50, 'a' + t);
+                        wad->createFile(name);
+                        if (wad->writeToFile(name, data.data(), data.size()) > 0)
+                        {
+                            uint32_t ack = (t << 24) | i; // 4 byte writes to a pipe are atomic
+                            if (write(acks[1], &ack, sizeof(ack)) != sizeof(ack))
+                                _exit(1);
+                        }
+                    }
+                });
+            }
+            for (auto &worker : workers)
+            {
+                worker.join();
+            }
+            _exit(0);
+        }
+
+        close(acks[1]);
+        this_thread::sleep_for(chrono::milliseconds(50 + random() % 500));
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+
+        vector<uint32_t> acked;
+        uint32_t ack;
+        while (read(acks[0], &ack, sizeof(ack)) == sizeof(ack))
+        {
+            acked.push_back(ack);
+        }
+        close(acks[0]);
+
+        int lost = 0;
+        try
+        {
+            Wad *wad = Wad::loadWad(copyPath);
+            vector<char> buffer(200);
+            for (uint32_t entry : acked)
+            {
+                int t = entry >> 24;
+                int i = entry & 0xFFFFFF;
+                int64_t n = wad->getContents(crashLumpName(t, i), buffer.data(), buffer.size());
+                if (n != 100 + i % 50 || count(buffer.begin(), buffer.begin() + n, char('a' + t)) != n)
+                {
+                    lost++;
+                }
+            }
+            delete wad;
+        }
+        catch (const runtime_error &e)
+        {
+            cerr << "wadbench: reload failed: " << e.what() << endl;
+            lost = acked.size() + 1;
+        }
+
+        cout << "round " << round + 1 << ": " << acked.size() << " acknowledged writes, " << lost << " lost or damaged" << endl;
+        failures += lost > 0;
+    }
+
+    remove(copyPath.c_str());
+    remove((copyPath + ".redo").c_str());
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 && string(argv[1]) == "--crash")
+    {
+        int failures = crashTest(argv[2], argc > 3 ? atoi(argv[3]) : 10, argc > 4 ? atoi(argv[4]) : 4);
+        return failures == 0 ? 0 : 1;
+    }
+
+    if (argc < 2)
+    {
+        cout << "Usage: wadbench <wad file> [threads] [ops per thread] [lump size]" << endl;
+        cout << "       wadbench --crash <wad file> [rounds] [threads]" << endl;
+        return 1;
+    }
+
+    string wadPath = argv[1];
+    int numThreads = argc > 2 ? atoi(argv[2]) : 4;
+    int opsPerThread = argc > 3 ? atoi(argv[3]) : 200;
+    int lumpSize = argc > 4 ? atoi(argv[4]) : 4096;
+
+    cout << numThreads << " threads x " << opsPerThread << " ops, " << lumpSize << " byte lumps" << endl;
+    cout << "none:     " << runMode(wadPath, Durability::None, numThreads, opsPerThread, lumpSize) << " ops/sec" << endl;
+    cout << "periodic: " << runMode(wadPath, Durability::Periodic, numThreads, opsPerThread, lumpSize) << " ops/sec" << endl;
+    cout << "group:    " << runMode(wadPath, Durability::GroupCommit, numThreads, opsPerThread, lumpSize) << " ops/sec" << endl;
+    return 0;
+}
@@ -0,0 +1,431 @@
+#include "../libWad/LumpScan.h"
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+using namespace std;
+
+// What the new WAD did to a lump of the same path
+enum class Change
+{
+    Unchanged,
+    Added,    // no lump at this path in the old WAD
+    Resized,  // sizes differ, so the contents weren't compared
+    Candidate, // same size, the content hashes decide
+    Modified
+};
+
+// Writes the patch front to back: a header placeholder, lump data as it is appended, then the table
+class PatchWriter
+{
+public:
+    PatchWriter(const string &path) : out(path, ios::binary | ios::trunc)
+    {
+        char header[12] = {};
+        out.write(header, sizeof(header));
+        end = sizeof(header);
+    }
+
+    bool good() const
+    {
+        return bool(out);
+    }
+
+    uint64_t append(const char *data, uint64_t length)
+    {
+        uint64_t offset = end;
+        out.write(data, length);
+        end += length;
+        return offset;
+    }
+
+    // Classic PWAD unless the patch outgrows 32-bit offsets, then the extended format libWad reads
+    bool finish(const vector<Descriptor> &table)
+    {
+        bool extended = end > UINT32_MAX;
+        uint64_t tableOffset = end;
+        if (extended)
+        {
+            vector<char> prefix = Wad::encodeTablePrefix(table.size(), 1);
+            out.write(prefix.data(), prefix.size());
+        }
+
+        vector<char> raw(Wad::descriptorSize(extended));
+        for (const Descriptor &descriptor : table)
+        {
+            Wad::encodeDescriptor(descriptor, extended, raw.data());
+            out.write(raw.data(), raw.size());
+        }
+
+        vector<char> header = Wad::encodeHeader(extended ? "XWAD" : "PWAD", extended, table.size(), tableOffset);
+        out.seekp(0, ios::beg);
+        out.write(header.data(), header.size());
+        out.close();
+        return !out.fail();
+    }
+
+private:
+    ofstream out;
+    uint64_t end;
+};
+
+static string baseName(const string &path)
+{
+    return path.substr(path.rfind('/') + 1);
+}
+
+class Differ
+{
+public:
+    Differ(Wad *oldWad, Wad *newWad, int numThreads) : oldWad(oldWad), newWad(newWad), numThreads(numThreads) {}
+
+    // Aligns the two WADs by path and hashes the old side of every lump whose size didn't change,
+    // false if a lump couldn't be read
+    bool compare()
+    {
+        vector<LumpInfo> oldLumps;
+        oldWad->getLumps(&oldLumps);
+        unordered_map<string, const LumpInfo *> oldByPath;
+        for (const LumpInfo &lump : oldLumps)
+        {
+            oldByPath[lump.path] = &lump;
+        }
+
+        newWad->getLumps(&newLumps);
+        changes.assign(newLumps.size(), Change::Added);
+        oldHashes.assign(newLumps.size(), 0);
+        oldLengths.assign(newLumps.size(), 0);
+        patchOffsets.assign(newLumps.size(), 0);
+        patchLengths.assign(newLumps.size(), 0);
+
+        // Sizes first, only lumps of equal size are worth reading on both sides. Stored lengths
+        // usually settle it, getSize is only asked when compression could hide an equal size.
+        vector<LumpInfo> oldCandidates;
+        vector<size_t> candidates; // index into newLumps of each candidate
+        for (size_t i = 0; i < newLumps.size(); i++)
+        {
+            const LumpInfo &lump = newLumps[i];
+            pathIndex[lump.path] = i;
+            auto old = oldByPath.find(lump.path);
+            if (old == oldByPath.end())
+            {
+                continue;
+            }
+            const LumpInfo &oldLump = *old->second;
+            oldByPath.erase(old);
+
+            if (oldLump.length != lump.length && oldWad->getSize(oldLump.path) != newWad->getSize(lump.path))
+            {
+                changes[i] = Change::Resized;
+                continue;
+            }
+            changes[i] = Change::Candidate;
+            oldCandidates.push_back(oldLump);
+            candidates.push_back(i);
+        }
+
+        // Whatever is left only exists in the old WAD, a PWAD can't take it away
+        for (auto &entry : oldByPath)
+        {
+            removed.push_back(entry.first);
+        }
+        sort(removed.begin(), removed.end());
+
+        scanContents(oldWad, oldCandidates, [&](size_t k, const char *data, uint64_t length)
+        {
+            if (data != nullptr)
+            {
+                oldHashes[candidates[k]] = Wad::hashBytes(data, length);
+                oldLengths[candidates[k]] = length;
+            }
+        });
+        return readErrors == 0;
+    }
+
+    // Reads the new WAD once, streaming every changed lump into the patch, then writes its table
+    bool writePatch(const string &patchPath)
+    {
+        PatchWriter patch(patchPath);
+        if (!patch.good())
+        {
+            cerr << "waddiff: can't create " << patchPath << endl;
+            return false;
+        }
+
+        // Lumps are appended in scan order whichever worker finishes first, so the patch comes out
+        // the same on every run. The pool starts jobs in that order, so whoever holds the turn is
+        // already running.
+        vector<size_t> turns(newLumps.size());
+        vector<size_t> order = scanOrder(newLumps);
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            turns[order[k]] = k;
+        }
+        mutex turnMutex;
+        condition_variable turnTaken;
+        size_t nextTurn = 0;
+
+        // Unchanged lumps are still read here, but that's the only read: their hash is taken and
+        // the bytes are dropped, anything else goes straight to the patch. A 64-bit hash and an
+        // equal size count as equal contents.
+        scanContents(newWad, newLumps, [&](size_t index, const char *data, uint64_t length)
+        {
+            if (data != nullptr && changes[index] == Change::Candidate)
+            {
+                bool same = length == oldLengths[index] && Wad::hashBytes(data, length) == oldHashes[index];
+                changes[index] = same ? Change::Unchanged : Change::Modified;
+            }
+
+            unique_lock<mutex> lock(turnMutex);
+            turnTaken.wait(lock, [&]() { return nextTurn == turns[index]; });
+            if (data != nullptr && inPatch(index))
+            {
+                patchLengths[index] = length;
+                patchOffsets[index] = patch.append(data, length);
+            }
+            nextTurn++;
+            turnTaken.notify_all();
+        });
+
+        vector<Descriptor> table;
+        collectEntries(patch, "/", table);
+        bool finished = patch.finish(table);
+        if (!finished)
+        {
+            cerr << "waddiff: can't write " << patchPath << endl;
+        }
+        return finished && readErrors == 0;
+    }
+
+    void report(bool list)
+    {
+        uint64_t counts[5] = {};
+        for (size_t i = 0; i < newLumps.size(); i++)
+        {
+            counts[int(changes[i])]++;
+            if (list && changes[i] != Change::Unchanged)
+            {
+                cout << (changes[i] == Change::Added ? "A " : "M ") << newLumps[i].path << endl;
+            }
+        }
+        if (list)
+        {
+            for (const string &path : removed)
+            {
+                cout << "D " << path << endl;
+            }
+        }
+
+        cout << counts[int(Change::Modified)] + counts[int(Change::Resized)] << " modified, " << counts[int(Change::Added)]
+             << " added, " << counts[int(Change::Unchanged)] << " unchanged, " << removed.size() << " removed" << endl;
+        cout << "patch has " << patchLumps << " lumps, " << patchBytes << " bytes" << endl;
+        if (!removed.empty())
+        {
+            cout << "lumps missing from the new WAD can't be expressed in a patch WAD and are left out" << endl;
+        }
+    }
+
+private:
+    // Reads the lumps in on-disk order and hands each one's uncompressed bytes to visit on the pool,
+    // so every lump is read exactly once and the hashing runs in parallel. A lump that can't be read
+    // is reported, counted in readErrors and handed over as nullptr.
+    void scanContents(Wad *wad, const vector<LumpInfo> &lumps, const function<void(size_t, const char *, uint64_t)> &visit)
+    {
+        scanLumps(wad, lumps, numThreads, [&](size_t k, const char *stored)
+        {
+            if (stored == nullptr)
+            {
+                readFailed(lumps[k].path);
+                visit(k, nullptr, 0);
+                return;
+            }
+            vector<char> unpacked;
+            if (Wad::unpackLump(stored, lumps[k].length, unpacked))
+            {
+                visit(k, unpacked.data(), unpacked.size());
+            }
+            else
+            {
+                visit(k, stored, lumps[k].length);
+            }
+        },
+        [&](size_t k)
+        {
+            int64_t size = wad->getSize(lumps[k].path);
+            vector<char> data(max<int64_t>(size, 0));
+            if (size < 0 || wad->getContents(lumps[k].path, data.data(), data.size()) != size)
+            {
+                readFailed(lumps[k].path);
+                visit(k, nullptr, 0);
+                return;
+            }
+            visit(k, data.data(), data.size());
+        });
+    }
+
+    void readFailed(const string &path)
+    {
+        cerr << "waddiff: can't read " << path << endl;
+        readErrors++;
+    }
+
+    bool inPatch(size_t index) const
+    {
+        return changes[index] != Change::Unchanged;
+    }
+
+    // Walks the new tree in order and keeps only what the patch needs: changed lumps, the
+    // namespaces around them, and whole maps, since an engine replaces a map as a unit
+    bool collectEntries(PatchWriter &patch, const string &dirPath, vector<Descriptor> &table)
+    {
+        vector<string> entries;
+        newWad->getDirectory(dirPath, &entries);
+        size_t tableStart = table.size();
+        for (const string &entry : entries)
+        {
+            string child = dirPath + entry;
+            if (!newWad->isDirectory(child))
+            {
+                auto found = pathIndex.find(child);
+                if (found != pathIndex.end() && inPatch(found->second))
+                {
+                    table.push_back(lumpEntry(found->second));
+                }
+                continue;
+            }
+
+            if (Wad::isMapMarker(entry))
+            {
+                addMap(patch, child, table);
+                continue;
+            }
+
+            size_t markerIndex = table.size();
+            table.push_back({0, 0, 0, entry + "_START", nullptr});
+            if (collectEntries(patch, child + "/", table))
+            {
+                table.push_back({0, 0, 0, entry + "_END", nullptr});
+            }
+            else
+            {
+                table.resize(markerIndex); // nothing changed in this namespace
+            }
+        }
+        return table.size() > tableStart;
+    }
+
+    void addMap(PatchWriter &patch, const string &mapPath, vector<Descriptor> &table)
+    {
+        vector<string> entries;
+        newWad->getDirectory(mapPath, &entries);
+        vector<size_t> indices;
+        bool changed = false;
+        for (const string &entry : entries)
+        {
+            auto found = pathIndex.find(mapPath + "/" + entry);
+            if (found != pathIndex.end())
+            {
+                indices.push_back(found->second);
+                changed = changed || inPatch(found->second);
+            }
+        }
+        if (!changed)
+        {
+            return;
+        }
+
+        table.push_back({0, 0, 0, baseName(mapPath), nullptr});
+        for (size_t index : indices)
+        {
+            if (!inPatch(index)) // unchanged lumps of a changed map, read again since they weren't kept
+            {
+                int64_t size = newWad->getSize(newLumps[index].path);
+                vector<char> data(max<int64_t>(size, 0));
+                if (size < 0 || newWad->getContents(newLumps[index].path, data.data(), data.size()) != size)
+                {
+                    readFailed(newLumps[index].path);
+                }
+                else
+                {
+                    patchLengths[index] = size;
+                    patchOffsets[index] = patch.append(data.data(), size);
+                }
+            }
+            table.push_back(lumpEntry(index));
+        }
+    }
+
+    Descriptor lumpEntry(size_t index)
+    {
+        patchLumps++;
+        patchBytes += patchLengths[index];
+        return {patchOffsets[index], patchLengths[index], 0, baseName(newLumps[index].path), nullptr};
+    }
+
+    Wad *oldWad;
+    Wad *newWad;
+    int numThreads;
+    vector<LumpInfo> newLumps;
+    unordered_map<string, size_t> pathIndex; // path -> index into newLumps
+    vector<Change> changes;
+    vector<uint64_t> oldHashes;
+    vector<uint64_t> oldLengths;
+    vector<uint64_t> patchOffsets;
+    vector<uint64_t> patchLengths;
+    vector<string> removed;
+    atomic<int> readErrors{0};
+    uint64_t patchLumps = 0;
+    uint64_t patchBytes = 0;
+};
+// Compares two versions of a WAD and writes a patch WAD holding only what changed.
+// Exits with 1 if a WAD can't be opened, a lump can't be read or the patch can't be written.
+int main(int argc, char *argv[])
+{
+    vector<string> paths;
+    int numThreads = thread::hardware_concurrency() ? thread::hardware_concurrency() : 4;
+    bool list = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--list")
+            list = true;
+        else if (arg.rfind("--threads=", 0) == 0)
+            numThreads = max(1, atoi(arg.c_str() + 10));
+        else
+            paths.push_back(arg);
+    }
+
+    if (paths.size() != 3)
+    {
+        cout << "Usage: waddiff [--threads=N] [--list] <old wad> <new wad> <patch wad>" << endl;
+        return 1;
+    }
+
+    Wad *oldWad = nullptr;
+    Wad *newWad = nullptr;
+    try
+    {
+        oldWad = Wad::loadWad(paths[0]);
+        newWad = Wad::loadWad(paths[1]);
+    }
+    catch (const runtime_error &e)
+    {
+        cerr << "waddiff: " << e.what() << endl;
+        delete oldWad;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    Differ differ(oldWad, newWad, numThreads);
+    bool written = differ.compare() && differ.writePatch(paths[2]);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (written)
+    {
+        differ.report(list);
+        cout << "diffed in " << seconds << " s" << endl;
+    }
+    delete newWad;
+    delete oldWad;
+    return written ? 0 : 1;
+}
@@ -0,0 +1,290 @@
+#include "../libWad/LumpScan.h"
+#include <sys/stat.h>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <set>
+using namespace std;
+
+static const int64_t fuseChunkSize = 128 << 10;
+
+static atomic<int> failures(0); // rejected lumps and failed writes, any of them makes the exit code 1
+
+static bool makeDirectory(const string &path)
+{
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+// Names come straight from the WAD, so they must not be able to walk out of the output directory
+static bool isSafeName(const string &name)
+{
+    return !name.empty() && name != "." && name != ".." && name.find('/') == string::npos;
+}
+
+static bool isSafePath(const string &wadPath)
+{
+    size_t start = 1; // skip the root
+    while (start <= wadPath.size())
+    {
+        size_t end = wadPath.find('/', start);
+        if (end == string::npos)
+            end = wadPath.size();
+        if (!isSafeName(wadPath.substr(start, end - start)))
+            return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+// Whether a file written to outPath + wadPath really lands under outRoot (the resolved output
+// directory), which also catches symlinks already sitting in the output tree. Parents are
+// resolved once and remembered.
+static bool staysInside(const string &outRoot, const string &outPath, const string &wadPath, set<string> &checkedParents)
+{
+    string parent = outPath + wadPath.substr(0, wadPath.rfind('/'));
+    if (checkedParents.count(parent))
+        return true;
+
+    char resolved[PATH_MAX];
+    if (realpath(parent.c_str(), resolved) == nullptr)
+        return false;
+    string dir = resolved;
+    if (dir != outRoot && dir.compare(0, outRoot.size() + 1, outRoot + "/") != 0)
+        return false;
+
+    checkedParents.insert(parent);
+    return true;
+}
+
+static void reject(const string &wadPath)
+{
+    cerr << "wadextract: skipping " << wadPath << ", its name would leave the output directory" << endl;
+    failures++;
+}
+
+// Recreates every directory, including empty namespaces and map markers
+static int extractDirectories(Wad *wad, const string &wadPath, const string &outPath)
+{
+    int numDirectories = 0;
+    vector<string> entries;
+    wad->getDirectory(wadPath, &entries);
+    for (const string &entry : entries)
+    {
+        string child = wadPath + entry;
+        if (wad->isDirectory(child))
+        {
+            if (!isSafeName(entry))
+            {
+                reject(child);
+                continue;
+            }
+            if (!makeDirectory(outPath + child))
+            {
+                cerr << "wadextract: can't create " << outPath + child << ": " << strerror(errno) << endl;
+                failures++;
+                continue;
+            }
+            numDirectories += 1 + extractDirectories(wad, child + "/", outPath);
+        }
+    }
+    return numDirectories;
+}
+
+static bool writeFile(const string &path, const char *data, uint64_t length)
+{
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(data, length);
+    if (!out)
+    {
+        cerr << "wadextract: can't write " << path << endl;
+        failures++;
+        return false;
+    }
+    return true;
+}
+
+// Returns the lump's logical size
+static uint64_t writeLump(const LumpInfo *lump, const char *stored, const string &outPath)
+{
+    vector<char> unpacked;
+    if (Wad::unpackLump(stored, lump->length, unpacked))
+    {
+        writeFile(outPath + lump->path, unpacked.data(), unpacked.size());
+        return unpacked.size();
+    }
+    writeFile(outPath + lump->path, stored, lump->length);
+    return lump->length;
+}
+
+// Lumps too big to buffer whole are copied through getContents in span sized pieces
+static uint64_t streamLump(Wad *wad, const LumpInfo *lump, const string &outPath)
+{
+    ofstream out(outPath + lump->path, ios::binary | ios::trunc);
+    vector<char> buffer(spanSize);
+    int64_t size = wad->getSize(lump->path);
+    int64_t offset = 0;
+    while (offset < size && out)
+    {
+        int64_t n = wad->getContents(lump->path, buffer.data(), buffer.size(), offset);
+        if (n <= 0)
+        {
+            break;
+        }
+        out.write(buffer.data(), n);
+        offset += n;
+    }
+    if (!out || offset < size)
+    {
+        cerr << "wadextract: can't write " << outPath + lump->path << endl;
+        failures++;
+    }
+    return offset;
+}
+
+static uint64_t extract(Wad *wad, const string &outPath, int numThreads)
+{
+    if (!makeDirectory(outPath))
+    {
+        cerr << "wadextract: can't create " << outPath << ": " << strerror(errno) << endl;
+        return 0;
+    }
+    extractDirectories(wad, "/", outPath);
+
+    char resolved[PATH_MAX];
+    if (realpath(outPath.c_str(), resolved) == nullptr)
+    {
+        cerr << "wadextract: can't resolve " << outPath << ": " << strerror(errno) << endl;
+        failures++;
+        return 0;
+    }
+    string outRoot = resolved;
+
+    vector<LumpInfo> allLumps, lumps;
+    wad->getLumps(&allLumps);
+    set<string> checkedParents;
+    for (LumpInfo &lump : allLumps)
+    {
+        if (!isSafePath(lump.path) || !staysInside(outRoot, outPath, lump.path, checkedParents))
+        {
+            reject(lump.path);
+            continue;
+        }
+        lumps.push_back(lump);
+    }
+
+    // Sizes are summed as lumps are written, asking getSize up front would probe every lump out of order
+    atomic<uint64_t> totalBytes(0);
+    scanLumps(wad, lumps, numThreads, [&](size_t index, const char *stored)
+    {
+        if (stored == nullptr)
+        {
+            cerr << "wadextract: short read of " << lumps[index].path << endl;
+            failures++;
+            return;
+        }
+        totalBytes += writeLump(&lumps[index], stored, outPath);
+    },
+    [&](size_t index) { totalBytes += streamLump(wad, &lumps[index], outPath); });
+
+    return totalBytes;
+}
+
+// What cp -r over wadfs does: one path lookup and a getContents call per FUSE read
+static uint64_t extractLikeFuse(Wad *wad, const string &wadPath, const string &outPath)
+{
+    uint64_t totalBytes = 0;
+    vector<char> buffer(fuseChunkSize);
+    vector<string> entries;
+    wad->getDirectory(wadPath, &entries);
+    for (const string &entry : entries)
+    {
+        string child = wadPath + entry;
+        if (!isSafeName(entry))
+        {
+            continue; // already reported by the real extraction
+        }
+        if (wad->isDirectory(child))
+        {
+            makeDirectory(outPath + child);
+            totalBytes += extractLikeFuse(wad, child + "/", outPath);
+            continue;
+        }
+
+        ofstream out(outPath + child, ios::binary | ios::trunc);
+        int64_t size = wad->getSize(child);
+        for (int64_t offset = 0; offset < size;)
+        {
+            int64_t n = wad->getContents(child, buffer.data(), fuseChunkSize, offset);
+            if (n <= 0)
+            {
+                break;
+            }
+            out.write(buffer.data(), n);
+            offset += n;
+        }
+        totalBytes += size;
+    }
+    return totalBytes;
+}
+
+int main(int argc, char *argv[])
+{
+    string wadPath, outPath;
+    int numThreads = thread::hardware_concurrency() ? thread::hardware_concurrency() : 4;
+    bool compare = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--compare")
+            compare = true;
+        else if (arg.rfind("--threads=", 0) == 0)
+            numThreads = max(1, atoi(arg.c_str() + 10));
+        else if (wadPath.empty())
+            wadPath = arg;
+        else
+            outPath = arg;
+    }
+
+    if (wadPath.empty() || outPath.empty())
+    {
+        cout << "Usage: wadextract [--threads=N] [--compare] <wad file> <output directory>" << endl;
+        return 1;
+    }
+    while (outPath.size() > 1 && outPath.back() == '/')
+    {
+        outPath.pop_back();
+    }
+
+    Wad *wad;
+    try
+    {
+        wad = Wad::loadWad(wadPath);
+    }
+    catch (const runtime_error &e)
+    {
+        cerr << "wadextract: " << e.what() << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint64_t totalBytes = extract(wad, outPath, numThreads);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "extracted " << totalBytes << " bytes in " << seconds << " s, " << totalBytes / seconds / (1 << 20) << " MB/s" << endl;
+
+    if (compare)
+    {
+        string fusePath = outPath + ".fuse";
+        makeDirectory(fusePath);
+        start = chrono::steady_clock::now();
+        totalBytes = extractLikeFuse(wad, "/", fusePath);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "fuse path " << totalBytes << " bytes in " << seconds << " s, " << totalBytes / seconds / (1 << 20) << " MB/s" << endl;
+    }
+
+    delete wad;
+    return failures == 0 ? 0 : 1;
+}
@@ -6,15 +6,300 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <algorithm>
+#include <sstream>
+#include <fnmatch.h>
 #define FUSE_USE_VERSION 26
 #include "../libWad/Wad.cpp"
 using namespace std;
 
+// Synthetic query directory: /.find/<pattern>/ lists every lump matching the pattern.
+// FUSE names can't hold '/', so ':' stands in for it both in the pattern (":F:F1:FLAT*")
+// and in the listed entries ("F:F1:FLAT1"), which resolve back onto the real lumps.
+static const string findRoot = "/.find";
+
+static string decodeQueryName(string name)
+{
+    replace(name.begin(), name.end(), ':', '/');
+    return name;
+}
+
+static string encodeQueryName(string path)
+{
+    if (path.back() == '/')
+        path.pop_back(); // directories come back with a trailing '/'
+    replace(path.begin(), path.end(), '/', ':');
+    return path.substr(1); // drop the leading root
+}
+
+// Same rule as Wad::find: a pattern starting with '/' matches whole paths, anything else lump names
+static bool matchesQuery(const string &pattern, const string &entryPath)
+{
+    if (pattern[0] == '/')
+        return fnmatch(pattern.c_str(), entryPath.c_str(), FNM_PATHNAME) == 0;
+    return fnmatch(pattern.c_str(), entryPath.substr(entryPath.rfind('/') + 1).c_str(), 0) == 0;
+}
+
+// Splits a path under /.find into its pattern and the real WAD path it points at.
+// Returns 0 if the path is not under /.find, -ENOENT if it names an entry the pattern doesn't
+// match, 1 otherwise; realPath is empty for /.find and /.find/<pattern>.
+static int splitQueryPath(const string &path, string &pattern, string &realPath)
+{
+    if (path.compare(0, findRoot.size(), findRoot) != 0 || (path.size() > findRoot.size() && path[findRoot.size()] != '/'))
+        return 0;
+
+    pattern.clear();
+    realPath.clear();
+
+    size_t patternStart = findRoot.size() + 1;
+    if (patternStart >= path.size())
+        return 1; // /.find itself
+
+    size_t patternEnd = path.find('/', patternStart);
+    pattern = decodeQueryName(path.substr(patternStart, patternEnd - patternStart));
+    if (patternEnd == string::npos || patternEnd + 1 >= path.size())
+        return 1; // /.find/<pattern>
+
+    size_t entryEnd = path.find('/', patternEnd + 1);
+    realPath = "/" + decodeQueryName(path.substr(patternEnd + 1, entryEnd - patternEnd - 1));
+    if (pattern.empty() || !matchesQuery(pattern, realPath)) // only what the listing shows can be looked up
+        return -ENOENT;
+    if (entryEnd != string::npos)
+        realPath += path.substr(entryEnd); // anything below a matched directory
+    return 1;
+}
+
+// Snapshot directory: `mkdir /.snapshots/<name>` keeps a read-only view of the WAD as it is at that
+// moment under /.snapshots/<name>/, `rmdir` drops it. A view has its own lock, so reading it never
+// waits on writers to the live tree.
+static const string snapshotRoot = "/.snapshots";
+
+// Splits a path under /.snapshots into the snapshot name and the path inside the snapshot.
+// Returns false if the path is not under /.snapshots; name is empty for /.snapshots itself.
+static bool splitSnapshotPath(const string &path, string &name, string &innerPath)
+{
+    if (path.compare(0, snapshotRoot.size(), snapshotRoot) != 0 || (path.size() > snapshotRoot.size() && path[snapshotRoot.size()] != '/'))
+        return false;
+
+    name.clear();
+    innerPath = "/";
+
+    size_t nameStart = snapshotRoot.size() + 1;
+    if (nameStart >= path.size())
+        return true; // /.snapshots itself
+
+    size_t nameEnd = path.find('/', nameStart);
+    name = path.substr(nameStart, nameEnd - nameStart);
+    if (nameEnd != string::npos)
+        innerPath = path.substr(nameEnd);
+    return true;
+}
+
+// Multi-WAD mode (--multi): one process serves several WADs, each as a directory of the mount root,
+// so they share FUSE's worker threads and one chunk cache budget (--cache-size). Writing
+// "add <wad file> [name]" or "remove <name>" lines to /.control changes what is served at runtime,
+// reading it lists the mounted WADs, and /.stats has counters for each of them.
+static const string controlPath = "/.control";
+static const string statsPath = "/.stats";
+
+// A WAD being served, with the counters shown in /.stats
+struct Mount
+{
+    string name;
+    string wadPath;
+    shared_ptr<Wad> wad; // operations in flight keep it alive after a remove
+    atomic<uint64_t> reads{0};
+    atomic<uint64_t> bytesRead{0};
+    atomic<uint64_t> writes{0};
+    atomic<uint64_t> bytesWritten{0};
+    atomic<uint64_t> errors{0};
+};
+
+// Every WAD the process serves. Outside multi-WAD mode it holds a single WAD, mounted at the root.
+class MountTable
+{
+public:
+    MountTable(const LoadOptions &options, bool multi) : options(options), multi(multi) {}
+
+    bool isMulti() const
+    {
+        return multi;
+    }
+
+    int add(const string &wadPath, const string &name)
+    {
+        if (multi && (name.empty() || name[0] == '.' || name.find('/') != string::npos))
+        {
+            cerr << "wadfs: invalid name: " << name << endl;
+            return -EINVAL;
+        }
+        if (findMount(name))
+        {
+            return -EEXIST;
+        }
+
+        // Loading can take a while, lookups on the other WADs carry on meanwhile
+        auto mount = make_shared<Mount>();
+        mount->name = name;
+        mount->wadPath = wadPath;
+        try
+        {
+            mount->wad = shared_ptr<Wad>(Wad::loadWad(wadPath, options));
+        }
+        catch (const exception &e)
+        {
+            cerr << "wadfs: " << e.what() << endl;
+            return -EIO;
+        }
+
+        unique_lock<shared_mutex> lock(mountsMutex);
+        return mounts.emplace(name, mount).second ? 0 : -EEXIST;
+    }
+
+    int remove(const string &name)
+    {
+        unique_lock<shared_mutex> lock(mountsMutex);
+        return mounts.erase(name) ? 0 : -ENOENT;
+    }
+
+    // Finds the WAD a path belongs to and the path inside it, nullptr for the multi-WAD root and
+    // anything not under a mounted WAD
+    shared_ptr<Mount> resolve(const string &path, string &innerPath)
+    {
+        if (!multi)
+        {
+            innerPath = path;
+            return findMount("");
+        }
+
+        size_t nameEnd = path.find('/', 1);
+        innerPath = nameEnd == string::npos ? "/" : path.substr(nameEnd);
+        return path.size() > 1 ? findMount(path.substr(1, nameEnd - 1)) : nullptr;
+    }
+
+    int getNames(vector<string> *names)
+    {
+        shared_lock<shared_mutex> lock(mountsMutex);
+        for (auto &entry : mounts)
+        {
+            names->push_back(entry.first);
+        }
+        return mounts.size();
+    }
+
+    // Contents of /.control: one "<name> <wad file>" line per WAD
+    string listing()
+    {
+        shared_lock<shared_mutex> lock(mountsMutex);
+        ostringstream out;
+        for (auto &entry : mounts)
+        {
+            out << entry.first << " " << entry.second->wadPath << "\n";
+        }
+        return out.str();
+    }
+
+    // Contents of /.stats: the shared cache, then one line of counters per WAD
+    string stats()
+    {
+        vector<shared_ptr<Mount>> snapshot;
+        {
+            shared_lock<shared_mutex> lock(mountsMutex);
+            for (auto &entry : mounts)
+            {
+                snapshot.push_back(entry.second);
+            }
+        }
+
+        ostringstream out;
+        if (options.cacheBudget)
+        {
+            out << "cache used=" << options.cacheBudget->getUsed() << " limit=" << options.cacheBudget->getLimit() << "\n";
+        }
+        for (auto &mount : snapshot)
+        {
+            CacheStats cache = mount->wad->getCacheStats();
+            TreeMemoryUsage tree = mount->wad->getMemoryUsage();
+            out << mount->name << " reads=" << mount->reads << " read_bytes=" << mount->bytesRead << " writes=" << mount->writes
+                << " write_bytes=" << mount->bytesWritten << " errors=" << mount->errors << " cache_hits=" << cache.hits
+                << " cache_misses=" << cache.misses << " cache_bytes=" << cache.bytes << " tree_nodes=" << tree.nodes
+                << " tree_bytes=" << tree.nodeBytes + tree.tableBytes << "\n";
+        }
+        return out.str();
+    }
+
+    // Runs the commands written to /.control, stops at the first one that fails
+    int control(const string &commands)
+    {
+        istringstream lines(commands);
+        string line;
+        while (getline(lines, line))
+        {
+            istringstream words(line);
+            string command, argument, name;
+            words >> command >> argument >> name;
+            if (command.empty())
+                continue;
+
+            int result;
+            if (command == "add" && !argument.empty() && argument[0] == '/') // the daemon's cwd isn't the caller's
+                result = add(argument, name.empty() ? defaultName(argument) : name);
+            else if (command == "remove" && !argument.empty())
+                result = remove(argument);
+            else
+                result = -EINVAL;
+
+            if (result != 0)
+            {
+                cerr << "wadfs: " << line << " failed: " << strerror(-result) << endl;
+                return result;
+            }
+        }
+        return 0;
+    }
+
+    // The file name without its directory and extension, "/data/doom2.wad" is served as /doom2
+    static string defaultName(const string &wadPath)
+    {
+        string name = wadPath.substr(wadPath.rfind('/') + 1);
+        size_t dot = name.rfind('.');
+        return dot == 0 || dot == string::npos ? name : name.substr(0, dot);
+    }
+
+private:
+    shared_ptr<Mount> findMount(const string &name)
+    {
+        shared_lock<shared_mutex> lock(mountsMutex);
+        auto it = mounts.find(name);
+        return it == mounts.end() ? nullptr : it->second;
+    }
+
+    LoadOptions options; // every WAD is loaded with these, cacheBudget is shared by all of them
+    bool multi;
+    shared_mutex mountsMutex;
+    map<string, shared_ptr<Mount>> mounts;
+};
+
+static MountTable *getMounts()
+{
+    return (MountTable *)fuse_get_context()->private_data;
+}
+
+// Copies the part of a generated file a read asked for
+static int readText(const string &text, char *buffer, size_t size, off_t offset)
+{
+    if (offset >= (off_t)text.size())
+        return 0;
+    size_t length = min(size, text.size() - offset);
+    memcpy(buffer, text.data() + offset, length);
+    return length;
+}
+
 // All functions use this source: https://maastaar.net/fuse/linux/filesystem/c/2019/09/28/writing-less-simple-yet-stupid-filesystem-using-FUSE-in-C/
 static int do_getattr(const char *path, struct stat *st)
 {
     memset(st, 0, sizeof(struct stat));
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
+    MountTable *mounts = getMounts();
 
     time_t current_time = time(NULL);
     printf("Current time: %ld\n", current_time);
@@ -24,14 +309,71 @@ static int do_getattr(const char *path, struct stat *st)
     st->st_atime = time(NULL); // The last "a"ccess of the file/directory is right now
     st->st_mtime = time(NULL); // The last "m"odification of the file/directory is right now
 
+    if (mounts->isMulti())
+    {
+        if (strcmp(path, "/") == 0)
+        {
+            st->st_mode = S_IFDIR | 0755;
+            st->st_nlink = 2;
+            return 0;
+        }
+        if (path == controlPath || path == statsPath)
+        {
+            st->st_mode = S_IFREG | (path == controlPath ? 0644 : 0444);
+            st->st_nlink = 1;
+            st->st_size = path == controlPath ? mounts->listing().size() : mounts->stats().size();
+            return 0;
+        }
+    }
+
+    string mountPath;
+    shared_ptr<Mount> mount = mounts->resolve(path, mountPath);
+    if (!mount)
+        return -ENOENT;
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath;
+    int query = splitQueryPath(path, pattern, queryPath);
+    if (query < 0)
+        return query;
+    if (query)
+    {
+        if (queryPath.empty()) // /.find and /.find/<pattern> are always directories
+        {
+            st->st_mode = S_IFDIR | 0555;
+            st->st_nlink = 2;
+            return 0;
+        }
+        path = queryPath.c_str();
+    }
+
+    string snapshotName, snapshotPath;
+    shared_ptr<Wad> snapshot; // keeps the view alive until we're done with it
+    if (splitSnapshotPath(path, snapshotName, snapshotPath))
+    {
+        if (snapshotName.empty()) // /.snapshots
+        {
+            st->st_mode = S_IFDIR | 0755;
+            st->st_nlink = 2;
+            return 0;
+        }
+        snapshot = wad->getSnapshot(snapshotName);
+        if (!snapshot)
+            return -ENOENT;
+        wad = snapshot.get();
+        path = snapshotPath.c_str();
+    }
+    mode_t writable = snapshot ? 0 : 0222; // snapshots are read only
+
     if (wad->isDirectory(path))
     {
-        st->st_mode = S_IFDIR | 0777;
+        st->st_mode = S_IFDIR | 0555 | writable;
         st->st_nlink = 2;
     }
     else if (wad->isContent(path) == 1)
     {
-        st->st_mode = S_IFREG | 0777;
+        st->st_mode = S_IFREG | 0555 | writable;
         st->st_nlink = 1;
         st->st_size = wad->getSize(path);
     }
@@ -48,10 +390,53 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, of
     filler(buffer, ".", NULL, 0);  // Current Directory
     filler(buffer, "..", NULL, 0); // Parent Directory
 
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
-
+    MountTable *mounts = getMounts();
     vector<string> directories;
-    wad->getDirectory(path, &directories);
+    string mountPath;
+    shared_ptr<Mount> mount = mounts->resolve(path, mountPath);
+    if (!mount)
+    {
+        if (!mounts->isMulti() || strcmp(path, "/") != 0)
+            return -ENOENT;
+
+        mounts->getNames(&directories); // the multi-WAD root holds one directory per WAD
+        for (const auto &directory : directories)
+            filler(buffer, directory.c_str(), nullptr, 0);
+        return 0;
+    }
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath;
+    int query = splitQueryPath(path, pattern, queryPath);
+    if (query < 0)
+        return query;
+
+    string snapshotName, snapshotPath;
+    if (splitSnapshotPath(path, snapshotName, snapshotPath))
+    {
+        if (snapshotName.empty())
+        {
+            wad->getSnapshots(&directories);
+        }
+        else if (shared_ptr<Wad> snapshot = wad->getSnapshot(snapshotName))
+        {
+            snapshot->getDirectory(snapshotPath, &directories);
+        }
+    }
+    else if (query && queryPath.empty())
+    {
+        vector<string> matches;
+        if (!pattern.empty())
+            wad->find(pattern, &matches);
+
+        for (const auto &match : matches)
+            directories.push_back(encodeQueryName(match));
+    }
+    else
+    {
+        wad->getDirectory(queryPath.empty() ? path : queryPath, &directories);
+    }
 
     for (const auto &directory : directories) // add in the directories from wad
     {
@@ -63,11 +448,48 @@ static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, of
 
 static int do_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
+    MountTable *mounts = getMounts();
+    if (mounts->isMulti() && path == controlPath)
+        return readText(mounts->listing(), buffer, size, offset);
+    if (mounts->isMulti() && path == statsPath)
+        return readText(mounts->stats(), buffer, size, offset);
+
+    string mountPath;
+    shared_ptr<Mount> mount = mounts->resolve(path, mountPath);
+    if (!mount)
+        return -ENOENT;
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath;
+    int query = splitQueryPath(path, pattern, queryPath);
+    if (query < 0)
+        return query;
+    if (query)
+        path = queryPath.c_str();
+
+    string snapshotName, snapshotPath;
+    shared_ptr<Wad> snapshot;
+    if (splitSnapshotPath(path, snapshotName, snapshotPath))
+    {
+        snapshot = wad->getSnapshot(snapshotName);
+        if (!snapshot)
+            return -ENOENT;
+        wad = snapshot.get();
+        path = snapshotPath.c_str();
+    }
 
     if (wad->isContent(path))
     {
-        return wad->getContents(path, buffer, size, offset);
+        int64_t numRead = wad->getContents(path, buffer, size, offset);
+        if (numRead < 0)
+        {
+            mount->errors++;
+            return -EIO; // -1 also means the lump failed its checksum with --verify
+        }
+        mount->reads++;
+        mount->bytesRead += numRead;
+        return (int)numRead;
     }
 
     return -ENOENT; // the file doesn't exist
@@ -75,15 +497,60 @@ static int do_read(const char *path, char *buffer, size_t size, off_t offset, st
 
 static int do_mkdir(const char *path, mode_t mode)
 {
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
+    string mountPath;
+    shared_ptr<Mount> mount = getMounts()->resolve(path, mountPath);
+    if (!mount)
+        return -EPERM; // WADs are added through /.control
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath;
+    if (splitQueryPath(path, pattern, queryPath)) // query results are read only
+        return -EROFS;
+
+    string snapshotName, snapshotPath;
+    if (splitSnapshotPath(path, snapshotName, snapshotPath))
+    {
+        if (snapshotName.empty() || snapshotPath != "/") // only new snapshots can be made in here
+            return -EROFS;
+        return wad->createSnapshot(snapshotName) ? 0 : -EEXIST;
+    }
+
     wad->createDirectory(path);
 
     return 0;
 }
 
+static int do_rmdir(const char *path)
+{
+    string mountPath;
+    shared_ptr<Mount> mount = getMounts()->resolve(path, mountPath);
+    if (!mount)
+        return -EPERM; // WADs are removed through /.control
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    // Only snapshots can be removed, the WAD itself has no way to delete a directory
+    string snapshotName, snapshotPath;
+    if (!splitSnapshotPath(path, snapshotName, snapshotPath) || snapshotName.empty() || snapshotPath != "/")
+        return -EPERM;
+
+    return wad->dropSnapshot(snapshotName) ? 0 : -ENOENT;
+}
+
 static int do_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
+    string mountPath;
+    shared_ptr<Mount> mount = getMounts()->resolve(path, mountPath);
+    if (!mount)
+        return -EPERM;
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath, snapshotName;
+    if (splitQueryPath(path, pattern, queryPath) || splitSnapshotPath(path, snapshotName, queryPath)) // query results and snapshots are read only
+        return -EROFS;
+
     wad->createFile(path);
 
     return 0;
@@ -91,26 +558,191 @@ static int do_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int do_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *info)
 {
-    Wad *wad = ((Wad *)fuse_get_context()->private_data);
-    wad->writeToFile(path, buffer, size, offset);
+    MountTable *mounts = getMounts();
+    if (mounts->isMulti() && path == controlPath) // each write is taken as whole command lines
+    {
+        int result = mounts->control(string(buffer, size));
+        return result == 0 ? (int)size : result;
+    }
+
+    string mountPath;
+    shared_ptr<Mount> mount = mounts->resolve(path, mountPath);
+    if (!mount)
+        return -EACCES;
+    Wad *wad = mount->wad.get();
+    path = mountPath.c_str();
+
+    string pattern, queryPath, snapshotName;
+    if (splitQueryPath(path, pattern, queryPath) || splitSnapshotPath(path, snapshotName, queryPath)) // query results and snapshots are read only
+        return -EROFS;
+
+    if (wad->writeToFile(path, buffer, size, offset) == -1) // a failed store, journal append or commit
+    {
+        mount->errors++;
+        return -EIO;
+    }
+    mount->writes++;
+    mount->bytesWritten += size;
 
     return size;
 }
 
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *info)
+{
+    string mountPath;
+    shared_ptr<Mount> mount = getMounts()->resolve(path, mountPath);
+    if (mount && !mount->wad->sync())
+        return -EIO; // the data or the redo log didn't make it to disk
+
+    return 0;
+}
+
+static int do_truncate(const char *path, off_t size)
+{
+    // Only lets `echo ... > /.control` through, lumps can't shrink
+    if (getMounts()->isMulti() && path == controlPath)
+        return 0;
+
+    return -EPERM;
+}
+
+static int do_open(const char *path, struct fuse_file_info *info)
+{
+    // The generated files change size between getattr and read, so they bypass the page cache
+    if (getMounts()->isMulti() && (path == controlPath || path == statsPath))
+        info->direct_io = 1;
+
+    return 0;
+}
+
 static struct fuse_operations operations = {
     .getattr = do_getattr,
     .mknod = do_mknod,
     .mkdir = do_mkdir,
+    .rmdir = do_rmdir,
+    .truncate = do_truncate,
+    .open = do_open,
     .read = do_read,
     .write = do_write,
+    .fsync = do_fsync,
     .readdir = do_readdir,
 };
 
 int main(int argc, char *argv[])
 {
+    // Pull out our own options, everything else goes to fuse
+    LoadOptions options;
+    bool multi = false;
+    size_t cacheSize = 0;
+    vector<string> initialWads;
+    int fuseArgc = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--dedup") // hash lumps on load so writes can share identical data
+        {
+            options.hashContents = true;
+        }
+        else if (arg == "--compress") // store written lumps as compressed chunks
+        {
+            options.compressWrites = true;
+        }
+        else if (arg == "--extended") // 64-bit offsets, lifts the 4 GB limit
+        {
+            options.extendedFormat = true;
+        }
+        else if (arg.compare(0, 13, "--shard-size=") == 0) // new lump data goes to shard files of this many MB
+        {
+            options.shardSize = stoull(arg.substr(13)) << 20;
+        }
+        else if (arg == "--durability=periodic") // commit in the background every --sync-interval ms
+        {
+            options.durability = Durability::Periodic;
+        }
+        else if (arg == "--durability=group") // writes return once a shared fsync has covered them
+        {
+            options.durability = Durability::GroupCommit;
+        }
+        else if (arg == "--durability=none")
+        {
+            options.durability = Durability::None;
+        }
+        else if (arg.compare(0, 16, "--sync-interval=") == 0)
+        {
+            options.syncIntervalMs = stoul(arg.substr(16));
+        }
+        else if (arg == "--lazy") // build a directory's lumps when it is first listed or read
+        {
+            options.lazyTree = true;
+        }
+        else if (arg == "--checksums") // keep <wad>.crc up to date as lumps are written
+        {
+            options.checksums = true;
+        }
+        else if (arg == "--verify") // check each lump against <wad>.crc on first read, EIO if it doesn't match
+        {
+            options.verifyReads = true;
+        }
+        else if (arg.compare(0, 14, "--tree-budget=") == 0) // with --lazy, MB of lump nodes kept before cold directories are dropped
+        {
+            options.lazyTree = true;
+            options.treeMemoryBudget = stoull(arg.substr(14)) << 20;
+        }
+        else if (arg == "--multi") // serve several WADs from this one mount, see /.control
+        {
+            multi = true;
+        }
+        else if (arg.compare(0, 6, "--add=") == 0) // with --multi, a WAD to serve from the start
+        {
+            multi = true;
+            initialWads.push_back(arg.substr(6));
+        }
+        else if (arg.compare(0, 13, "--cache-size=") == 0) // MB of decompressed chunks, shared by every WAD with --multi
+        {
+            cacheSize = stoull(arg.substr(13)) << 20;
+        }
+        else
+        {
+            argv[fuseArgc++] = argv[i];
+        }
+    }
+    argc = fuseArgc;
+
+    if (cacheSize > 0)
+    {
+        options.chunkCacheSize = cacheSize;
+    }
+
+    if (multi)
+    {
+        if (argc < 2)
+        {
+            cout << "Not enough arguments." << endl;
+            return 1;
+        }
+
+        options.cacheBudget = make_shared<CacheBudget>(options.chunkCacheSize);
+        MountTable *mounts = new MountTable(options, true);
+        for (string wadPath : initialWads)
+        {
+            if (wadPath.at(0) != '/')
+            {
+                wadPath = string(get_current_dir_name()) + "/" + wadPath;
+            }
+            if (mounts->add(wadPath, MountTable::defaultName(wadPath)) != 0)
+            {
+                cout << "Couldn't serve " << wadPath << endl;
+                return 1;
+            }
+        }
+
+        return fuse_main(argc, argv, &operations, mounts);
+    }
+
     if (argc < 3)
     {
         cout << "Not enough arguments." << endl;
+        return 1;
     }
 
     string wadPath = argv[argc - 2];
@@ -120,10 +752,14 @@ int main(int argc, char *argv[])
         wadPath = string(get_current_dir_name()) + "/" + wadPath;
     }
 
-    Wad *myWad = Wad::loadWad(wadPath);
+    MountTable *mounts = new MountTable(options, false);
+    if (mounts->add(wadPath, "") != 0)
+    {
+        return 1;
+    }
 
     argv[argc - 2] = argv[argc - 1];
     argc--;
 
-    return fuse_main(argc, argv, &operations, myWad);
+    return fuse_main(argc, argv, &operations, mounts);
 }
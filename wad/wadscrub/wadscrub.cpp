@@ -0,0 +1,70 @@
+#include "../libWad/Wad.h"
+#include <chrono>
+#include <cstdlib>
+using namespace std;
+
+// Builds or checks the per-lump CRC32C sidecar ("<wad>.crc") of a WAD.
+// Exits with 1 if the WAD can't be opened, 2 if any lump fails its checksum.
+int main(int argc, char *argv[])
+{
+    string wadPath;
+    bool build = false;
+    unsigned numThreads = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--build")
+            build = true;
+        else if (arg.rfind("--threads=", 0) == 0)
+            numThreads = atoi(arg.c_str() + 10);
+        else
+            wadPath = arg;
+    }
+
+    if (wadPath.empty())
+    {
+        cout << "Usage: wadscrub [--build] [--threads=N] <wad file>" << endl;
+        return 1;
+    }
+
+    Wad *wad;
+    try
+    {
+        wad = Wad::loadWad(wadPath);
+    }
+    catch (const runtime_error &e)
+    {
+        cerr << "wadscrub: " << e.what() << endl;
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    if (build)
+    {
+        int64_t numChecksums = wad->buildChecksums(numThreads);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        delete wad;
+        if (numChecksums < 0)
+        {
+            return 1;
+        }
+        cout << "checksummed " << numChecksums << " payloads in " << seconds << " s" << endl;
+        return 0;
+    }
+
+    ScrubReport report = wad->scrub(numThreads);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    delete wad;
+
+    cout << "checked " << report.lumpsChecked << " lumps, " << report.bytesChecked << " bytes in " << seconds << " s, "
+         << report.bytesChecked / seconds / (1 << 20) << " MB/s" << endl;
+    if (report.lumpsUnchecked > 0)
+    {
+        cout << report.lumpsUnchecked << " lumps have no checksum, run with --build to add them" << endl;
+    }
+    for (const string &path : report.corrupt)
+    {
+        cout << "corrupt: " << path << endl;
+    }
+    return report.corrupt.empty() ? 0 : 2;
+}